@@ -0,0 +1,20 @@
+/*
+ * allocator.h -- interface of the boundary-tag allocator in dmm1.c
+ *
+ * dmm1.c came from a heap allocator assignment built on top of segment.h;
+ * this header and segment.c let it build on its own (trace_bench uses it
+ * as one of the allocators it compares).
+ */
+#ifndef _ALLOCATOR_H
+#define _ALLOCATOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* must be called once before the first dmalloc */
+bool dmalloc_init();
+void *dmalloc(size_t requestedsz);
+void dfree(void *ptr);
+bool validate_heap();
+
+#endif
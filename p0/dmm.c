@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>  // needed for size_t
 #include <unistd.h> // needed for sbrk
 #include <assert.h> // needed for asserts
@@ -5,37 +6,25 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>    // needed for sched_getcpu
+#include <sys/mman.h> // needed for mmap
+#include <sys/stat.h>
+#include <sys/file.h> // needed for flock
+#include <fcntl.h>
 #include "dmm.h"
 
 
 
 
-// typedef struct metadata {
-//    size_t is the return type of the sizeof operator. Since the size of an
-//    * object depends on the architecture and its implementation, size_t is used
-//    * to represent the maximum size of any object in the particular
-//    * implementation. size contains the size of the data object or the number of
-//    * free bytes
-   
-//   size_t size;
-//   size_t state;
-//   char padding1; // padding to make the header 8 bytes
-//   char padding2;
-//   char padding3;
-//   struct metadata *next;
-//   struct metadata *prev;
-// } metadata_t;
-
-
-
-
-// Heap blocks are required to be aligned to 8-byte boundary
-#define ALIGNMENT 8
-
 // Number of free linked lists (one for each power of two from 2^3 to 2^30
 #define NUM_LISTS 28
 
+// log2 of the smallest size class (8 bytes)
+#define MIN_CLASS_SHIFT 3
+
 // if a heap chunk uses ACCEPTABLE_FRACTION or less of its available space,
 // the chunk is split into two parts
 #define ACCEPTABLE_FRACTION .5
@@ -44,193 +33,2252 @@
 // chunk is 8 bytes large
 #define SMALLEST_CUTTABLE_CHUNK 32
 
+// Requests up to this size are slots in runs, one class per multiple of ALIGNMENT
+#define SMALL_MAX_SIZE 256
+#define SMALL_CLASSES (SMALL_MAX_SIZE / ALIGNMENT)
+// Size and alignment of a run, one page
+#define RUN_SIZE 4096
+// Address space reserved for runs
+#define RUN_SPACE ((size_t)1 << 32)
+// One bit per slot of the smallest class
+#define RUN_BITMAP_WORDS (RUN_SIZE / ALIGNMENT / 64)
+
+// Alignment of everything dmalloc, dcalloc and drealloc return. The
+// LD_PRELOAD shim builds with 16, what the x86-64 ABI promises for malloc
+// (alignof(max_align_t)) and what SSE code generated for it relies on.
+#ifndef DMM_MALLOC_ALIGNMENT
+#define DMM_MALLOC_ALIGNMENT ALIGNMENT
+#endif
+
+// Small objects go through the per-thread cache, one magazine per small
+// class (build with -DDMM_NO_TCACHE to disable)
+// Capacity of one magazine
+#define TCACHE_MAG_SIZE 32
+// Objects moved between a magazine and the runs per refill/flush
+#define TCACHE_BATCH 16
+
+
+// Most arenas a process will use (DMM_ARENAS is clamped to this)
+#define MAX_ARENAS 16
+
+// Minimum size of an mmap'd region backing a secondary arena
+#define ARENA_REGION_SIZE (1024*1024)
+
+// Free space of at least this many bytes goes back to the OS (DMM_TRIM_THRESHOLD)
+#define DEFAULT_TRIM_THRESHOLD (128*1024)
+
+// An arena grows by a quarter of its current size, but at least HEAP_GROW_MIN
+// and at most HEAP_GROW_MAX bytes (more if one request needs it)
+#define HEAP_GROW_MIN (64*1024)
+#define HEAP_GROW_MAX (64*1024*1024)
+
+// Requests of at least this many bytes get their own mapping (DMM_MMAP_THRESHOLD)
+#define DEFAULT_MMAP_THRESHOLD (128*1024)
+// Bump blocks of a region start at this size and double up to the max,
+// which keeps them below the mmap threshold; dmm_region_reset may go past it
+#define REGION_BLOCK_MIN 4096
+#define REGION_BLOCK_MAX (64*1024)
+// A persistent heap file starts at and grows by at least this many bytes
+#define PERSIST_GROW_MIN (64*1024)
+// First bytes of a persistent heap file
+#define PERSIST_MAGIC "dmmheap"
+#define PERSIST_VERSION 1
+
+// Statistics counters, compiled out with -DDMM_NO_STATS
+#ifndef DMM_NO_STATS
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
+
 
-// Array of pointers to the begginings of the free lists
-metadata_t *freelist = NULL;
-metadata_t *lastVisited = NULL;
-void *bp0 = NULL;
+/* struct: segment_t
+ * ---------------
+ * A contiguous piece of heap memory (an sbrk'd range or an mmap'd
+ * region). Chunks follow the segment header back to back and the segment
+ * ends with an epilogue: a zero-sized, never free chunk header that stops
+ * coalescing from running off the end.
+ */
+typedef struct segment {
+  struct segment *next;
+  size_t size; // bytes from the segment header to the end of the epilogue
+} segment_t;
 
+#define SEGMENT_T_ALIGNED (ALIGN(sizeof(segment_t)))
 
+// Bookkeeping bytes of a segment on top of its chunks: header + epilogue
+#define SEGMENT_OVERHEAD (SEGMENT_T_ALIGNED + HEADER_SIZE)
 
-void split_chunk(metadata_t *ptr, size_t numbytes)
+
+/* struct: run_t
+ * ---------------
+ * A RUN_SIZE-aligned block of equal-sized slots for small objects,
+ * jemalloc style: the run header at its start has the slot size and a
+ * bitmap of the slots in use, so a small object needs no header of its
+ * own and its run is found by masking its address.
+ */
+typedef struct run {
+  struct run *next; // runs of the same class and arena with a free slot
+  struct run *prev;
+  uint32_t size;    // slot size
+  uint16_t nslots;
+  uint16_t nfree;
+  uint16_t hint;    // no bitmap word before this one has a free slot
+  uint8_t arena;
+  uint64_t bitmap[RUN_BITMAP_WORDS]; // bit set = slot in use
+} run_t;
+
+#define RUN_HEADER_SIZE (ALIGN(sizeof(run_t)))
+
+
+/* struct: arena_t
+ * ---------------
+ * An independent heap with its own lock, segments and size-class
+ * bins. Arena 0 is the main arena and grows through sbrk; every other
+ * arena grows from its own mmap'd regions. Chunks record their arena
+ * index so a free always goes back to the owner.
+ */
+typedef struct arena {
+  pthread_mutex_t lock;
+  int index;
+  // Every segment of this arena, most recent first; the main arena
+  // tries to grow its most recent one in place
+  segment_t *segments;
+  // Array of pointers to the begginings of the free lists, one per size class
+  metadata_t *bins[NUM_LISTS];
+  // Bit i is set iff bins[i] is non-empty
+  uint32_t bin_bitmap;
+  // Bytes in all segments, sets the pace of growth
+  size_t heap_size;
+  // Runs with a free slot, one list per small class; full runs are in no list
+  run_t *runs[SMALL_CLASSES];
+  // Where the next dmalloc_compact step resumes: a segment and the offset
+  // of a chunk in it, NULL to start a new pass at the newest segment
+  segment_t *compact_seg;
+  size_t compact_off;
+#ifndef DMM_NO_STATS
+  // dmalloc_stats counters, protected by lock like the rest
+  size_t free_blocks;
+  size_t sbrk_grows;
+  size_t region_maps;
+  size_t splits;
+  size_t coalesces;
+  size_t trimmed;
+  size_t madvised;
+  size_t remote_frees;
+  size_t compacted;
+  size_t fit_hist[DMM_FIT_HIST];
+  // Allocated bytes of the arena's chunks and runs, bytes of its segments
+  // and of the runs it carved, and their peaks. dmalloc_stats sums them.
+  size_t in_use;
+  size_t peak_in_use;
+  size_t heap_bytes;
+  size_t peak_heap_bytes;
+#endif
+  // Objects freed by threads of other arenas, linked through their first
+  // word; pushed without the lock, taken as a whole by the owner. On a
+  // cache line of its own so the pushes do not bounce the lock's line.
+  void *remote_head __attribute__((aligned(64)));
+} arena_t;
+
+arena_t arenas[MAX_ARENAS];
+int narenas = 1;
+// Threads pick an arena by the CPU they run on instead of round-robin
+static bool arena_by_cpu = false;
+static int next_arena = 0;
+static pthread_once_t arenas_once = PTHREAD_ONCE_INIT;
+static __thread arena_t *thread_arena = NULL;
+
+size_t mmap_threshold = DEFAULT_MMAP_THRESHOLD;
+size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+
+// Initial size of the main arena (DMM_HEAP_SIZE)
+static size_t initial_heap_size = MAX_HEAP_SIZE;
+
+// The run space: runs are carved from [run_space, run_space_end) at
+// run_next, empty runs of any class wait in free_runs for reuse.
+// Protected by run_lock, which nests inside the arena locks.
+static char *run_space = NULL;
+static char *run_space_end = NULL;
+static char *run_next = NULL;
+static run_t *free_runs = NULL;
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t run_space_once = PTHREAD_ONCE_INIT;
+
+#ifndef DMM_NO_STATS
+// Allocated bytes of mmap'd chunks, which belong to no arena. A shared
+// counter is fine next to the system call every change of it makes.
+static size_t mmap_bytes = 0;
+static size_t peak_mmap_bytes = 0;
+
+/* count_in_use: add delta to the arena's allocated bytes and raise its
+ * peak. Caller holds arena->lock.
+ */
+static inline void count_in_use(arena_t *arena, ssize_t delta)
 {
-  metadata_t *newChunk = NULL; 
-  
-  newChunk = (metadata_t *)ptr->end + numbytes;
-  newChunk->size = ptr->size - numbytes- sizeof(metadata_t);
-  newChunk->available = 1;
-  newChunk->next = ptr->next;
-  newChunk->prev = ptr;
-  
-   if((newChunk->next) != NULL)
-   {      
-      (newChunk->next)->prev = newChunk;
-   }
-  
-  ptr->size = numbytes;
-  ptr->available = 0;
-  ptr->next = newChunk;
+  arena->in_use += delta;
+  if(arena->in_use > arena->peak_in_use)
+    arena->peak_in_use = arena->in_use;
 }
 
+/* count_heap: add delta to the arena's heap size and raise its peak.
+ * Caller holds arena->lock.
+ */
+static inline void count_heap(arena_t *arena, ssize_t delta)
+{
+  arena->heap_bytes += delta;
+  if(arena->heap_bytes > arena->peak_heap_bytes)
+    arena->peak_heap_bytes = arena->heap_bytes;
+}
 
-metadata_t* extendH(metadata_t *lastVisitedPtr, size_t size)
+/* count_mmap: add delta to the bytes of mmap'd chunks and raise the peak */
+static inline void count_mmap(ssize_t delta)
 {
-  bp0 = sbrk(0);
-  metadata_t *curBreak = bp0;    //Current breakpoint of the heap
-  
-  if(sbrk(size + METADATA_T_ALIGNED) == (void*) -1)
+  size_t now = __atomic_add_fetch(&mmap_bytes, (size_t)delta, __ATOMIC_RELAXED);
+  size_t peak = __atomic_load_n(&peak_mmap_bytes, __ATOMIC_RELAXED);
+
+  while(now > peak && !__atomic_compare_exchange_n(&peak_mmap_bytes, &peak, now, true,
+                                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+#endif
+
+// Installs remote_exit for a thread once it pushes onto a remote stack
+static pthread_key_t remote_key;
+static pthread_once_t remote_key_once = PTHREAD_ONCE_INIT;
+static __thread bool remote_registered = false;
+
+#ifndef DMM_NO_TCACHE
+/* struct: magazine_t
+ * ---------------
+ * A stack of cached small objects of one class. Cached objects stay
+ * marked in use in their runs.
+ */
+typedef struct magazine {
+  int count;
+  void *slots[TCACHE_MAG_SIZE];
+} magazine_t;
+
+typedef struct tcache {
+  bool registered; // thread exit destructor installed
+  magazine_t mags[SMALL_CLASSES];
+} tcache_t;
+
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#endif
+
+
+/* Accessors for the packed size word and the boundary tags */
+static inline size_t chunk_size(metadata_t *chunk)
+{
+  return chunk->size & SIZE_MASK;
+}
+
+static inline int chunk_arena(metadata_t *chunk)
+{
+  return (int)(chunk->size >> ARENA_SHIFT);
+}
+
+static inline void *chunk_payload(metadata_t *chunk)
+{
+  return (char *)chunk + HEADER_SIZE;
+}
+
+static inline metadata_t *payload_chunk(void *ptr)
+{
+  return (metadata_t *)((char *)ptr - HEADER_SIZE);
+}
+
+static inline metadata_t *next_chunk(metadata_t *chunk)
+{
+  return (metadata_t *)((char *)chunk_payload(chunk) + chunk_size(chunk));
+}
+
+/* prev_chunk: only valid when chunk has PREV_FREE set, because only free
+ * chunks carry a footer.
+ */
+static inline metadata_t *prev_chunk(metadata_t *chunk)
+{
+  size_t prev_size = ((size_t *)chunk)[-1] & SIZE_MASK;
+
+  return (metadata_t *)((char *)chunk - prev_size - HEADER_SIZE);
+}
+
+/* set_size: change a chunk's payload size, keeping its arena and status bits */
+static inline void set_size(metadata_t *chunk, size_t size)
+{
+  chunk->size = (chunk->size & ~SIZE_MASK) | size;
+}
+
+static inline size_t make_header(size_t size, int arena, size_t bits)
+{
+  return size | ((size_t)arena << ARENA_SHIFT) | bits;
+}
+
+/* mark_free: set the free bit, write the footer and tell the next chunk */
+static inline void mark_free(metadata_t *chunk)
+{
+  chunk->size |= CHUNK_FREE;
+  *(size_t *)((char *)next_chunk(chunk) - SIZE_T_ALIGNED) = chunk->size;
+  next_chunk(chunk)->size |= PREV_FREE;
+}
+
+static inline void mark_used(metadata_t *chunk)
+{
+  chunk->size &= ~(size_t)CHUNK_FREE;
+  next_chunk(chunk)->size &= ~(size_t)PREV_FREE;
+}
+
+
+/* size_class: map a payload size to its bin, bin i holds sizes in
+ * [2^(i+3), 2^(i+4)), the last bin takes everything larger.
+ */
+static inline int size_class(size_t size)
+{
+  int c;
+
+  if(size < (1UL << MIN_CLASS_SHIFT))
+    return 0;
+  c = (int)(sizeof(unsigned long) * CHAR_BIT) - 1 - __builtin_clzl(size) - MIN_CLASS_SHIFT;
+  return c < NUM_LISTS ? c : NUM_LISTS - 1;
+}
+
+void bin_insert(arena_t *arena, metadata_t *ptr)
+{
+  int c = size_class(chunk_size(ptr));
+
+  ptr->prev_free = NULL;
+  ptr->next_free = arena->bins[c];
+  if(arena->bins[c] != NULL)
+    arena->bins[c]->prev_free = ptr;
+  arena->bins[c] = ptr;
+  arena->bin_bitmap |= 1U << c;
+  STAT(arena->free_blocks++);
+}
+
+void bin_remove(arena_t *arena, metadata_t *ptr)
+{
+  int c = size_class(chunk_size(ptr));
+
+  if(ptr->prev_free != NULL)
+    ptr->prev_free->next_free = ptr->next_free;
+  else
+    arena->bins[c] = ptr->next_free;
+  if(ptr->next_free != NULL)
+    ptr->next_free->prev_free = ptr->prev_free;
+  if(arena->bins[c] == NULL)
+    arena->bin_bitmap &= ~(1U << c);
+  STAT(arena->free_blocks--);
+}
+
+
+/* coalesce_prev: merge a chunk that is not in any bin into the chunk
+ * before it if that one is free.
+ *   retval: the chunk that now contains freed
+ */
+metadata_t* coalesce_prev(arena_t *arena, metadata_t *freed)
+{
+  metadata_t *prev;
+
+  if(freed->size & PREV_FREE)
+  {
+    prev = prev_chunk(freed);
+    bin_remove(arena, prev);
+    set_size(prev, chunk_size(prev) + HEADER_SIZE + chunk_size(freed));
+    STAT(arena->coalesces++);
+    return prev;
+  }
+  return freed;
+}
+
+/* coalesce_next: merge one freed chunk with the following chunk (in case it is free as well)
+     chunkStatus* freed: pointer to the block of memory to be freed.
+     retval: void, the function modifies the list
+*/
+void coalesce_next(arena_t *arena, metadata_t *freed)
+{
+  metadata_t *next;
+  next = next_chunk(freed);
+
+  if(next->size & CHUNK_FREE)
   {
+    bin_remove(arena, next);
+    set_size(freed, chunk_size(freed) + HEADER_SIZE + chunk_size(next));
+    STAT(arena->coalesces++);
+  }
+}
+
+/* heap_free: return a chunk to its arena. Caller holds arena->lock.
+ *   retval: the free chunk it ended up in after coalescing
+ */
+static metadata_t *heap_free(arena_t *arena, metadata_t *toFree) {
+  coalesce_next(arena, toFree);
+  toFree = coalesce_prev(arena, toFree);
+  mark_free(toFree);
+  bin_insert(arena, toFree);
+  return toFree;
+}
+
+
+/* split_chunk: cut an allocated chunk down to numbytes and free the
+ * remainder if it is big enough to be a chunk of its own.
+ */
+void split_chunk(arena_t *arena, metadata_t *ptr, size_t numbytes)
+{
+  metadata_t *newChunk = NULL;
+  size_t size = chunk_size(ptr);
+
+  if(size < numbytes + HEADER_SIZE + MIN_PAYLOAD)
+    return;
+
+  set_size(ptr, numbytes);
+  newChunk = next_chunk(ptr);
+  newChunk->size = make_header(size - numbytes - HEADER_SIZE, arena->index, 0);
+  heap_free(arena, newChunk);
+  STAT(arena->splits++);
+}
+
+/* add_segment: turn len bytes at base into a segment holding one free
+ * chunk, and put that chunk into its bin.
+ *   retval: the free chunk
+ */
+static metadata_t* add_segment(arena_t *arena, void *base, size_t len)
+{
+  segment_t *seg = base;
+  metadata_t *chunk, *epilogue;
+
+  seg->size = len;
+  seg->next = arena->segments;
+  arena->segments = seg;
+  arena->heap_size += len;
+  STAT(count_heap(arena, len));
+
+  chunk = (metadata_t *)((char *)base + SEGMENT_T_ALIGNED);
+  chunk->size = make_header(len - SEGMENT_OVERHEAD - HEADER_SIZE, arena->index, 0);
+  epilogue = next_chunk(chunk);
+  epilogue->size = make_header(0, arena->index, 0);
+  mark_free(chunk);
+  bin_insert(arena, chunk);
+  return chunk;
+}
+
+/* grow_step: how many bytes to add to an arena at least, so that the
+ * number of times it grows is logarithmic in its final size.
+ */
+static inline size_t grow_step(arena_t *arena)
+{
+  size_t step = arena->heap_size / 4;
+
+  if(step < HEAP_GROW_MIN)
+    step = HEAP_GROW_MIN;
+  if(step > HEAP_GROW_MAX)
+    step = HEAP_GROW_MAX;
+  return ALIGN(step);
+}
+
+/* extend_region: grow an arena by mmap'ing a new region of at least
+ * ARENA_REGION_SIZE. Secondary arenas always grow this way, the main arena
+ * when the break cannot move.
+ */
+static metadata_t* extend_region(arena_t *arena, size_t size)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t len = size + SEGMENT_OVERHEAD + HEADER_SIZE;
+  void *region;
+
+  if(len < grow_step(arena))
+    len = grow_step(arena);
+  len = (len + page - 1) & ~(page - 1);
+  if(len < ARENA_REGION_SIZE)
+    len = ARENA_REGION_SIZE;
+  region = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(region == MAP_FAILED)
     return NULL;
+  STAT(arena->region_maps++);
+
+  return add_segment(arena, region, len);
+}
+
+/* extendH: get memory for a chunk of at least size bytes and put it into
+ * the bins as a free chunk. The arena grows by at least grow_step bytes.
+ * When the break still sits at the end of the main arena's newest segment
+ * the segment grows in place (merging with a free last chunk), otherwise
+ * the new memory becomes a segment of its own: from sbrk if the break can
+ * move, from mmap if it cannot. Segments never merge with each other.
+ *   retval: the free chunk, NULL if the OS has no memory left
+ */
+metadata_t* extendH(arena_t *arena, size_t size)
+{
+  segment_t *top = arena->segments;
+  metadata_t *epilogue;
+  char *curBreak;
+  size_t need, pad;
+
+  if(arena->index != 0)
+    return extend_region(arena, size);
+
+  curBreak = sbrk(0);    //Current breakpoint of the heap
+
+  if(top != NULL && (char *)top + top->size == curBreak)
+  {
+    // The old epilogue becomes the header of the new chunk
+    epilogue = (metadata_t *)(curBreak - HEADER_SIZE);
+    need = size + HEADER_SIZE;
+    if(epilogue->size & PREV_FREE)
+      need = size - chunk_size(prev_chunk(epilogue));
+    if(need < grow_step(arena))
+      need = grow_step(arena);
+    if(sbrk(need) == (void*) -1)
+      return extend_region(arena, size);
+    STAT(arena->sbrk_grows++);
+    top->size += need;
+    arena->heap_size += need;
+    STAT(count_heap(arena, need));
+
+    set_size(epilogue, need - HEADER_SIZE);
+    next_chunk(epilogue)->size = make_header(0, arena->index, 0);
+    return heap_free(arena, epilogue);
+  }
+
+  // Someone else moved the break (or this is the first segment): start a new segment
+  pad = (ALIGNMENT - (uintptr_t)curBreak % ALIGNMENT) % ALIGNMENT;
+  need = size + SEGMENT_OVERHEAD + HEADER_SIZE;
+  if(need < grow_step(arena))
+    need = grow_step(arena);
+  if(sbrk(pad + need) == (void*) -1)
+  {
+    return extend_region(arena, size);
   }
-  
-  curBreak->size = size + METADATA_T_ALIGNED - sizeof(metadata_t);
-  curBreak->available = 0;
-  curBreak->next = NULL;
-  curBreak->prev = lastVisitedPtr;
-  lastVisitedPtr->next = curBreak;
-  
-  if(curBreak->size > size)
-    split_chunk(curBreak, size);
-  
-  return curBreak;  
+  STAT(arena->sbrk_grows++);
+  return add_segment(arena, curBreak + pad, need);
+}
+
+#ifndef DMM_NO_STATS
+/* count_fit: record a find_fit call that looked at steps chunks */
+static inline void count_fit(arena_t *arena, int steps)
+{
+  int b = steps == 0 ? 0 : 1 + (int)(sizeof(unsigned int) * CHAR_BIT) - 1 - __builtin_clz(steps);
+
+  arena->fit_hist[b < DMM_FIT_HIST ? b : DMM_FIT_HIST - 1]++;
 }
+#endif
 
-metadata_t* find_fit(metadata_t *header, size_t size)
+/* find_fit: first fit inside the request's own size class, then the
+ * occupancy bitmap gives the next non-empty larger class in O(1); any
+ * chunk there is big enough so we take the head.
+ */
+metadata_t* find_fit(arena_t *arena, size_t size)
 {
-  metadata_t* ptr = header;
-  
+  int c = size_class(size);
+  metadata_t* ptr = arena->bins[c];
+  uint32_t larger;
+  STAT(int steps = 0);
+
   while(ptr != NULL)
   {
-    if(ptr->size >= (size + sizeof(metadata_t)) && ptr->available == 1)
+    STAT(steps++);
+    if(chunk_size(ptr) >= size)
     {
+      STAT(count_fit(arena, steps));
       return ptr;
     }
-    lastVisited = ptr;
-    ptr = ptr->next;
-  }  
-  return ptr;  
+    ptr = ptr->next_free;
+  }
+
+  larger = c + 1 < NUM_LISTS ? arena->bin_bitmap & ~((1U << (c + 1)) - 1) : 0;
+  STAT(count_fit(arena, steps + (larger != 0)));
+  if(larger == 0)
+    return NULL;
+  return arena->bins[__builtin_ctz(larger)];
 }
 
 
+extern char **environ;
 
-bool dmalloc_init() {
-  
+/* dmm_getenv: getenv without calling into libc. Programs may interpose
+ * getenv with a version that allocates, which must not happen while the
+ * arenas are being set up.
+ */
+static char *dmm_getenv(const char *name)
+{
+  size_t len = strlen(name);
+  char **env;
+
+  for(env = environ; env != NULL && *env != NULL; env++)
+    if(strncmp(*env, name, len) == 0 && (*env)[len] == '=')
+      return *env + len + 1;
+  return NULL;
+}
+
+/* arenas_init: read the arena configuration once per process.
+ *   DMM_ARENAS          number of arenas (default: online CPUs, at most MAX_ARENAS)
+ *   DMM_ARENA_POLICY    "cpu" to pick the arena by current CPU, otherwise
+ *                       threads are assigned round-robin on first use
+ *   DMM_MMAP_THRESHOLD  requests of at least this many bytes are mmap'd
+ *   DMM_HEAP_SIZE       initial size of the main arena (default MAX_HEAP_SIZE)
+ *   DMM_TRIM_THRESHOLD  free space of at least this many bytes is given back
+ */
+static void arenas_init()
+{
+  char *env;
+  int i;
 
-  size_t max_bytes = ALIGN(MAX_HEAP_SIZE);
-  /* returns heap_region, which is initialized to freelist */
-  
+  narenas = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if((env = dmm_getenv("DMM_ARENAS")) != NULL)
+    narenas = atoi(env);
+  if(narenas < 1)
+    narenas = 1;
+  if(narenas > MAX_ARENAS)
+    narenas = MAX_ARENAS;
+  env = dmm_getenv("DMM_ARENA_POLICY");
+  arena_by_cpu = env != NULL && strcmp(env, "cpu") == 0;
+  if((env = dmm_getenv("DMM_MMAP_THRESHOLD")) != NULL)
+    dmalloc_set_mmap_threshold(strtoul(env, NULL, 0));
+  if((env = dmm_getenv("DMM_HEAP_SIZE")) != NULL)
+    initial_heap_size = strtoul(env, NULL, 0);
+  if((env = dmm_getenv("DMM_TRIM_THRESHOLD")) != NULL)
+    dmalloc_set_trim_threshold(strtoul(env, NULL, 0));
+
+  for(i = 0; i < MAX_ARENAS; i++) {
+    pthread_mutex_init(&arenas[i].lock, NULL);
+    arenas[i].index = i;
+  }
+}
+
+/* get_arena: the arena the calling thread allocates from */
+static inline arena_t *get_arena()
+{
+  int cpu;
+
+  if(arena_by_cpu) {
+#ifdef __linux__
+    cpu = sched_getcpu();
+#else
+    cpu = 0;
+#endif
+    return &arenas[(cpu < 0 ? 0 : cpu) % narenas];
+  }
+  if(thread_arena == NULL) {
+    pthread_once(&arenas_once, arenas_init);
+    thread_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % narenas];
+  }
+  return thread_arena;
+}
+
+/* heap_init: set up the main arena with bytes from sbrk, or from mmap
+ * if the break cannot move. Caller holds the main arena's lock.
+ */
+static bool heap_init(size_t bytes) {
+  char *bp0;
+  size_t pad;
+
+  size_t max_bytes = ALIGN(bytes);
+  if(max_bytes < SEGMENT_OVERHEAD + HEADER_SIZE + MIN_PAYLOAD)
+    max_bytes = SEGMENT_OVERHEAD + HEADER_SIZE + MIN_PAYLOAD;
 
   bp0 = sbrk(0);
-  void *bp1;
+  pad = (ALIGNMENT - (uintptr_t)bp0 % ALIGNMENT) % ALIGNMENT;
 
   /* Q: Why casting is used? i.e., why (void*)-1?  WHY? */
-  if (sbrk(max_bytes)== (void *) - 1)
-      return false;
+  if (sbrk(pad + max_bytes)== (void *) - 1)
+      return extend_region(&arenas[0], max_bytes - SEGMENT_OVERHEAD - HEADER_SIZE) != NULL;
+  STAT(arenas[0].sbrk_grows++);
  //Create the first chunk with size equals all memory available in the heap after setting the new breakpoint
-  bp1 = sbrk(0);
-  freelist = bp0;
-  freelist->size = max_bytes-METADATA_T_ALIGNED;
-  freelist->available = 0;
-  freelist->next = NULL;
-  freelist->prev = NULL;
- 
+  add_segment(&arenas[0], bp0 + pad, max_bytes);
+
   return true;
 }
 
+/* dmalloc_init: set up the main arena with its initial size (MAX_HEAP_SIZE
+ * or DMM_HEAP_SIZE). Caller holds the main arena's lock.
+ */
+bool dmalloc_init() {
+  return heap_init(initial_heap_size);
+}
 
+bool dmalloc_init_heap(size_t bytes) {
+  bool done = false;
 
-void *dmalloc(size_t numbytes) {
+  pthread_once(&arenas_once, arenas_init);
+  pthread_mutex_lock(&arenas[0].lock);
+  if(arenas[0].segments == NULL)
+    done = heap_init(bytes);
+  pthread_mutex_unlock(&arenas[0].lock);
+  return done;
+}
+
+
+
+/* trim_top: when chunk is the free last chunk of the main arena and the
+ * break still sits right behind it, move the break down so that only pad
+ * bytes (rounded up to whole pages) of it stay. Caller holds arena->lock.
+ *   retval: true if the break moved
+ */
+static bool trim_top(arena_t *arena, metadata_t *chunk, size_t pad)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  segment_t *top = arena->segments;
+  char *end = (char *)next_chunk(chunk) + HEADER_SIZE;
+  size_t release;
+
+  if(arena->index != 0 || top == NULL || (char *)top + top->size != end || sbrk(0) != end)
+    return false;
+  if(pad < MIN_PAYLOAD)
+    pad = MIN_PAYLOAD;
+  if(chunk_size(chunk) < pad + page)
+    return false;
+  release = (chunk_size(chunk) - pad) & ~(page - 1);
+  if(sbrk(-(intptr_t)release) == (void *)-1)
+    return false;
+
+  // the chunk keeps the part below the new break, a new epilogue follows
+  bin_remove(arena, chunk);
+  set_size(chunk, chunk_size(chunk) - release);
+  next_chunk(chunk)->size = make_header(0, arena->index, 0);
+  mark_free(chunk);
+  bin_insert(arena, chunk);
+  top->size -= release;
+  arena->heap_size -= release;
+  STAT(count_heap(arena, -(ssize_t)release));
+  STAT(arena->trimmed += release);
+  return true;
+}
+
+/* release_pages: give the whole pages of a free chunk that lie between
+ * from and to back to the OS. Its bin links at the start and its footer
+ * at the end stay, the pages in between read as zeros the next time they
+ * are touched. Caller holds arena->lock.
+ *   retval: bytes released
+ */
+static size_t release_pages(arena_t *arena, metadata_t *chunk, char *from, char *to)
+{
+  uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  char *lo = (char *)chunk_payload(chunk) + 2 * sizeof(metadata_t *);
+  char *hi = (char *)next_chunk(chunk) - SIZE_T_ALIGNED;
+
+  if(from < lo)
+    from = lo;
+  if(to > hi)
+    to = hi;
+  from = (char *)(((uintptr_t)from + page - 1) & ~(page - 1));
+  to = (char *)((uintptr_t)to & ~(page - 1));
+  if(to <= from || madvise(from, to - from, MADV_DONTNEED) != 0)
+    return 0;
+  STAT(arena->madvised += to - from);
+  return to - from;
+}
+
+/* heap_release: free a chunk the program is done with. Caller holds
+ * arena->lock. Once the free space it ends up in reaches trim_threshold,
+ * the memory goes back to the OS: by moving the break when it is the top
+ * of the main heap (keeping one grow_step, so that the next allocation
+ * does not grow it right back), otherwise by releasing the pages this
+ * free made unused (the rest of the chunk was released when it was freed).
+ */
+static void heap_release(arena_t *arena, metadata_t *toFree)
+{
+  char *from = (char *)toFree, *to = (char *)next_chunk(toFree);
+  metadata_t *chunk;
+
+  STAT(count_in_use(arena, -(ssize_t)chunk_size(toFree)));
+  chunk = heap_free(arena, toFree);
+  if(chunk_size(chunk) >= trim_threshold && !trim_top(arena, chunk, grow_step(arena)))
+    release_pages(arena, chunk, from, to);
+}
+
+/* heap_malloc: allocate numbytes (already aligned, at least MIN_PAYLOAD)
+ * from an arena. Caller holds arena->lock.
+ *   retval: the allocated chunk
+ */
+static metadata_t *heap_malloc(arena_t *arena, size_t numbytes) {
 
    /* initialize through sbrk call first time */
-  if(freelist == NULL) {      
+  if(arena->index == 0 && arena->segments == NULL) {
     if(!dmalloc_init())
       return NULL;
   }
 
-  assert(numbytes > 0);
-
-  
-  
-  metadata_t *ptr;
-  //Split the chunk into two: one with size request by user, other with the remainder.
-  ptr = freelist;
-    
-
-  // find the first free heap chunk that is big enough
+  // find a free heap chunk that is big enough
   metadata_t *smallest_chunk = NULL; //first chunk encountered that is big enough
-  smallest_chunk = find_fit(freelist, numbytes);
- 
+  smallest_chunk = find_fit(arena, numbytes);
+
 
   if(smallest_chunk == NULL){
-      //extend the heap 
-      smallest_chunk = extendH(lastVisited, numbytes);
-      return smallest_chunk->end;
-    }
-  else{
-    // cut the chunk down to a reasonable size
-    if(smallest_chunk->size > numbytes){
-      split_chunk(smallest_chunk, numbytes);
-      }
+      //extend the heap
+      smallest_chunk = extendH(arena, numbytes);
+      if(smallest_chunk == NULL)
+        return NULL;
+    }
+
+  bin_remove(arena, smallest_chunk);
+  mark_used(smallest_chunk);
+  // cut the chunk down to a reasonable size
+  if(chunk_size(smallest_chunk) > numbytes){
+    split_chunk(arena, smallest_chunk, numbytes);
     }
-  
-  return smallest_chunk->end;
+  STAT(count_in_use(arena, chunk_size(smallest_chunk)));
+
+  return smallest_chunk;
 }
 
-void coalesce_prev(metadata_t *freed)
-{ 
-  metadata_t *prev;
-  prev = freed->prev;
-  
-  if(prev != NULL && prev->available == 1)
-  {
-    prev->size = prev->size + freed->size + sizeof(metadata_t);
-    prev->next = freed->next;
-    if( (freed->next) != NULL )
-      freed->next->prev = prev;
+/* run_space_init: reserve the address range for runs. Pages are only
+ * committed once a run carved from them is touched.
+ */
+static void run_space_init() {
+  char *space = mmap(NULL, RUN_SPACE + RUN_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if(space == MAP_FAILED)
+    return;
+  run_next = (char *)(((uintptr_t)space + RUN_SIZE - 1) & ~(uintptr_t)(RUN_SIZE - 1));
+  run_space_end = run_next + RUN_SPACE;
+  run_space = run_next;
+}
+
+/* is_small: whether ptr is a slot in a run rather than a chunk */
+static inline bool is_small(void *ptr) {
+  return (char *)ptr >= run_space && (char *)ptr < run_space_end;
+}
+
+static inline run_t *ptr_run(void *ptr) {
+  return (run_t *)((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1));
+}
+
+/* small_class: class of an ALIGNed size of at most SMALL_MAX_SIZE; size 0
+ * has no class, callers turn it into a minimal request first */
+static inline int small_class(size_t size) {
+  assert(size > 0);
+  return (int)(size / ALIGNMENT) - 1;
+}
+
+/* run_new: start a run of size-byte slots for an arena, reusing an empty
+ * run if there is one. Caller holds arena->lock.
+ *   retval: the run, NULL if the run space is exhausted
+ */
+static run_t *run_new(arena_t *arena, size_t size) {
+  run_t *run = NULL;
+  int i;
+
+  pthread_once(&run_space_once, run_space_init);
+  pthread_mutex_lock(&run_lock);
+  if(free_runs != NULL) {
+    run = free_runs;
+    free_runs = run->next;
+  } else if(run_next != NULL && run_next < run_space_end) {
+    run = (run_t *)run_next;
+    run_next += RUN_SIZE;
+    STAT(count_heap(arena, RUN_SIZE));
+  }
+  pthread_mutex_unlock(&run_lock);
+  if(run == NULL)
+    return NULL;
+
+  run->size = size;
+  run->nslots = (RUN_SIZE - RUN_HEADER_SIZE) / size;
+  run->nfree = run->nslots;
+  run->hint = 0;
+  run->arena = arena->index;
+  // slots past the end are marked in use so they are never found
+  for(i = 0; i < RUN_BITMAP_WORDS; i++) {
+    if(i * 64 + 64 <= run->nslots)
+      run->bitmap[i] = 0;
+    else if(i * 64 >= run->nslots)
+      run->bitmap[i] = ~(uint64_t)0;
+    else
+      run->bitmap[i] = ~(uint64_t)0 << (run->nslots - i * 64);
   }
+  run->prev = NULL;
+  run->next = arena->runs[small_class(size)];
+  if(run->next != NULL)
+    run->next->prev = run;
+  arena->runs[small_class(size)] = run;
+  return run;
 }
 
-/* coalesce_next: merge one freed chunk with the following chunk (in case it is free as well)
-     chunkStatus* freed: pointer to the block of memory to be freed.
-     retval: void, the function modifies the list
-*/
-void coalesce_next(metadata_t *freed)
-{  
-  metadata_t *next;
-  next = freed->next;
-  
-  if(next != NULL && next->available == 1)
-  {
-    freed->size = freed->size + sizeof(metadata_t) + next->size;
-    freed->next = next->next;
-    if( (next->next) != NULL )
-      (next->next)->prev = freed;
+/* run_unlink: take a run out of its arena's list */
+static inline void run_unlink(arena_t *arena, run_t *run) {
+  if(run->prev != NULL)
+    run->prev->next = run->next;
+  else
+    arena->runs[small_class(run->size)] = run->next;
+  if(run->next != NULL)
+    run->next->prev = run->prev;
+}
+
+/* run_alloc: take the first free slot of the first run with one. Caller
+ * holds arena->lock.
+ */
+static void *run_alloc(arena_t *arena, size_t size) {
+  run_t *run = arena->runs[small_class(size)];
+  int w, bit;
+
+  if(run == NULL && (run = run_new(arena, size)) == NULL)
+    return NULL;
+
+  // find first zero; nfree > 0, so there is one
+  for(w = run->hint; run->bitmap[w] == ~(uint64_t)0; w++)
+    ;
+  bit = __builtin_ctzll(~run->bitmap[w]);
+  run->bitmap[w] |= (uint64_t)1 << bit;
+  run->hint = w;
+  if(--run->nfree == 0)
+    run_unlink(arena, run);
+  return (char *)run + RUN_HEADER_SIZE + (size_t)(w * 64 + bit) * run->size;
+}
+
+/* run_free: clear ptr's bit. A full run goes back into its list, an
+ * empty one is handed to free_runs unless it is the last run of its
+ * class. Caller holds the lock of the run's arena.
+ */
+static void run_free(arena_t *arena, run_t *run, void *ptr) {
+  int i = ((char *)ptr - (char *)run - RUN_HEADER_SIZE) / run->size;
+  uint64_t bit = (uint64_t)1 << (i % 64);
+
+  if(!(run->bitmap[i / 64] & bit))
+    return; // double free
+  run->bitmap[i / 64] &= ~bit;
+  if(i / 64 < run->hint)
+    run->hint = i / 64;
+  STAT(count_in_use(arena, -(ssize_t)run->size));
+
+  if(run->nfree++ == 0) {
+    run->prev = NULL;
+    run->next = arena->runs[small_class(run->size)];
+    if(run->next != NULL)
+      run->next->prev = run;
+    arena->runs[small_class(run->size)] = run;
+  } else if(run->nfree == run->nslots && (run->prev != NULL || run->next != NULL)) {
+    run_unlink(arena, run);
+    pthread_mutex_lock(&run_lock);
+    run->next = free_runs;
+    free_runs = run;
+    pthread_mutex_unlock(&run_lock);
   }
 }
-void dfree(void *ptr) {
 
-  metadata_t *toFree = NULL;
-  toFree = ptr - sizeof(metadata_t);
-  
-  if(toFree >= freelist && toFree <= (size_t *)bp0)
-  {
-    toFree->available = 1;  
-    coalesce_next(toFree);
-    coalesce_prev(toFree);
-  
+/* remote_drain: free everything other threads pushed onto the arena's
+ * remote stack. Caller holds arena->lock.
+ */
+static void remote_drain(arena_t *arena) {
+  void *ptr, *next;
+
+  if(__atomic_load_n(&arena->remote_head, __ATOMIC_RELAXED) == NULL)
+    return;
+  ptr = __atomic_exchange_n(&arena->remote_head, NULL, __ATOMIC_ACQUIRE);
+  for(; ptr != NULL; ptr = next) {
+    next = *(void **)ptr;
+    if(is_small(ptr))
+      run_free(arena, ptr_run(ptr), ptr);
+    else
+      heap_release(arena, payload_chunk(ptr));
+    STAT(arena->remote_frees++);
   }
 }
 
-/* for debugging; can be turned off through -NDEBUG flag*/
-void print_freelist() {
-  metadata_t *freelist_head = freelist;
-  while(freelist_head != NULL) {
-    DEBUG("\tfreelist Size:%zd, Head:%p, Prev:%p, Next:%p\t",
-	  freelist_head->size,
-	  freelist_head,
-	  freelist_head->prev,
-	  freelist_head->next);
-    freelist_head = freelist_head->next;
+/* remote_exit: drain every arena's remote stack when a thread that pushed
+ * onto them exits (pthread key destructor). The owner drains its stack the
+ * next time it takes its lock to allocate, but an arena no thread
+ * allocates from any more would keep the objects until dmalloc_trim.
+ */
+static void remote_exit(void *unused) {
+  int a;
+
+  remote_registered = false;
+  for(a = 0; a < narenas; a++) {
+    if(__atomic_load_n(&arenas[a].remote_head, __ATOMIC_RELAXED) == NULL)
+      continue;
+    pthread_mutex_lock(&arenas[a].lock);
+    remote_drain(&arenas[a]);
+    pthread_mutex_unlock(&arenas[a].lock);
+  }
+}
+
+static void remote_make_key() {
+  pthread_key_create(&remote_key, remote_exit);
+}
+
+/* remote_register: have the thread's remote frees drained when it exits;
+ * pushes made by later destructors (the cache flush) register again */
+static void remote_register() {
+  pthread_once(&remote_key_once, remote_make_key);
+  pthread_setspecific(remote_key, &remote_registered);
+  remote_registered = true;
+}
+
+/* remote_push: hand the objects first..last, already linked through
+ * their first words, to another arena without taking its lock. The owner
+ * only ever takes the whole stack, so a plain CAS push has no ABA.
+ */
+static void remote_push(arena_t *owner, void *first, void *last) {
+  void *head = __atomic_load_n(&owner->remote_head, __ATOMIC_RELAXED);
+
+  if(!remote_registered)
+    remote_register();
+  do {
+    *(void **)last = head;
+  } while(!__atomic_compare_exchange_n(&owner->remote_head, &head, first, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+#ifndef DMM_NO_TCACHE
+/* tcache_release: give count cached objects back to their runs. Objects
+ * of the thread's own arena are freed under one lock acquisition, those of
+ * other arenas are pushed onto their owners' remote stacks, consecutive
+ * objects of the same owner in a single push.
+ */
+static void tcache_release(void **slots, int count) {
+  arena_t *mine = get_arena(), *owner, *pending = NULL;
+  void *first = NULL, *last = NULL;
+  bool locked = false;
+  run_t *run;
+  int i;
+
+  for(i = 0; i < count; i++) {
+    run = ptr_run(slots[i]);
+    owner = &arenas[run->arena];
+    if(owner == mine) {
+      if(!locked) {
+        pthread_mutex_lock(&mine->lock);
+        locked = true;
+      }
+      run_free(mine, run, slots[i]);
+      continue;
+    }
+    if(owner != pending) {
+      if(pending != NULL)
+        remote_push(pending, first, last);
+      pending = owner;
+      first = slots[i];
+    } else {
+      *(void **)last = slots[i];
+    }
+    last = slots[i];
+  }
+  if(pending != NULL)
+    remote_push(pending, first, last);
+  if(locked)
+    pthread_mutex_unlock(&mine->lock);
+}
+
+/* tcache_flush_all: hand every cached object of the exiting thread back
+ * to its run (pthread key destructor).
+ */
+static void tcache_flush_all(void *unused) {
+  int i;
+
+  for(i = 0; i < SMALL_CLASSES; i++) {
+    tcache_release(tcache.mags[i].slots, tcache.mags[i].count);
+    tcache.mags[i].count = 0;
+  }
+}
+
+static void tcache_make_key() {
+  pthread_key_create(&tcache_key, tcache_flush_all);
+}
+
+/* tcache_register: have the thread's magazines flushed when it exits */
+static void tcache_register() {
+  pthread_once(&tcache_key_once, tcache_make_key);
+  pthread_setspecific(tcache_key, &tcache);
+  tcache.registered = true;
+}
+
+/* tcache_refill: move up to TCACHE_BATCH objects of class size into the
+ * empty magazine with a single lock round trip.
+ */
+static void tcache_refill(arena_t *arena, magazine_t *mag, size_t size) {
+  void *ptr;
+
+  if(!tcache.registered)
+    tcache_register();
+
+  pthread_mutex_lock(&arena->lock);
+  remote_drain(arena);
+  while(mag->count < TCACHE_BATCH) {
+    ptr = run_alloc(arena, size);
+    if(ptr == NULL)
+      break;
+    mag->slots[mag->count++] = ptr;
+  }
+  STAT(count_in_use(arena, mag->count * size));
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/* tcache_flush: the magazine is full, give the TCACHE_BATCH oldest objects
+ * back and keep the most recently freed (cache-hot) ones.
+ */
+static void tcache_flush(magazine_t *mag) {
+  tcache_release(mag->slots, TCACHE_BATCH);
+  memmove(mag->slots, mag->slots + TCACHE_BATCH, (mag->count - TCACHE_BATCH) * sizeof(void *));
+  mag->count -= TCACHE_BATCH;
+}
+#endif
+
+void dmalloc_set_mmap_threshold(size_t bytes) {
+  mmap_threshold = bytes;
+}
+
+void dmalloc_set_trim_threshold(size_t bytes) {
+  trim_threshold = bytes;
+}
+
+/* dmalloc_trim: give back everything the heap does not use: the top of
+ * the main arena down to pad bytes and the interior pages of every free
+ * chunk of every arena. Chunks in the threads' caches count as used.
+ */
+int dmalloc_trim(size_t pad) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  metadata_t *chunk, *top;
+  arena_t *arena;
+  int a, i, released = 0;
+
+  for(a = 0; a < narenas; a++) {
+    arena = &arenas[a];
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    if(a == 0 && arena->segments != NULL) {
+      top = (metadata_t *)((char *)arena->segments + arena->segments->size - HEADER_SIZE);
+      if((top->size & PREV_FREE) && trim_top(arena, prev_chunk(top), pad))
+        released = 1;
+    }
+    // bins below one page cannot hold a whole page
+    for(i = size_class(page); i < NUM_LISTS; i++) {
+      for(chunk = arena->bins[i]; chunk != NULL; chunk = chunk->next_free)
+        if(release_pages(arena, chunk, (char *)chunk, (char *)next_chunk(chunk)) != 0)
+          released = 1;
+    }
+    pthread_mutex_unlock(&arena->lock);
+  }
+  return released;
+}
+
+/* page_round: length of a mapping that holds a header plus numbytes */
+static inline size_t page_round(size_t numbytes) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  return (numbytes + HEADER_SIZE + page - 1) & ~(page - 1);
+}
+
+/* mmap_chunk: give a large request a mapping of its own, so dfree can hand
+ * the memory straight back to the kernel.
+ */
+static void *mmap_chunk(size_t numbytes) {
+  size_t len = page_round(numbytes);
+  metadata_t *chunk;
+
+  chunk = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(chunk == MAP_FAILED)
+    return NULL;
+  chunk->size = make_header(len - HEADER_SIZE, 0, CHUNK_MMAPPED);
+  STAT(count_mmap(len - HEADER_SIZE));
+  return chunk_payload(chunk);
+}
+
+/* request_size: the chunk payload size used for a request of numbytes */
+static inline size_t request_size(size_t numbytes) {
+  numbytes = ALIGN(numbytes);
+  return numbytes < MIN_PAYLOAD ? MIN_PAYLOAD : numbytes;
+}
+
+/* small_malloc: a slot of size bytes from the thread's magazine or the
+ * arena's runs
+ *   retval: NULL if the run space is exhausted
+ */
+static void *small_malloc(arena_t *arena, size_t size) {
+#ifndef DMM_NO_TCACHE
+  magazine_t *mag = &tcache.mags[small_class(size)];
+
+  if(mag->count == 0) {
+    tcache_refill(arena, mag, size);
+    if(mag->count == 0)
+      return NULL;
+  }
+  return mag->slots[--mag->count];
+#else
+  void *ptr;
+
+  pthread_mutex_lock(&arena->lock);
+  remote_drain(arena);
+  ptr = run_alloc(arena, size);
+  STAT(if(ptr != NULL) count_in_use(arena, size));
+  pthread_mutex_unlock(&arena->lock);
+  return ptr;
+#endif
+}
+
+/* small_free: give a slot back through the thread's magazine or straight
+ * to its run
+ */
+static void small_free(void *ptr) {
+  run_t *run = ptr_run(ptr);
+#ifndef DMM_NO_TCACHE
+  magazine_t *mag = &tcache.mags[small_class(run->size)];
+
+  // a thread that only frees must flush on exit too
+  if(!tcache.registered)
+    tcache_register();
+  if(mag->count == TCACHE_MAG_SIZE)
+    tcache_flush(mag);
+  mag->slots[mag->count++] = ptr;
+#else
+  arena_t *arena = &arenas[run->arena];
+
+  if(arena != get_arena()) {
+    remote_push(arena, ptr, ptr);
+    return;
+  }
+  pthread_mutex_lock(&arena->lock);
+  run_free(arena, run, ptr);
+  pthread_mutex_unlock(&arena->lock);
+#endif
+}
+
+void *dmalloc(size_t numbytes) {
+  arena_t *arena;
+  metadata_t *chunk;
+  void *ptr;
+
+  // a minimal block, as the heap gave before there were size classes
+  if(numbytes == 0)
+    numbytes = 1;
+#if DMM_MALLOC_ALIGNMENT > ALIGNMENT
+  return dmemalign(DMM_MALLOC_ALIGNMENT, numbytes);
+#endif
+  arena = get_arena();
+
+  if(ALIGN(numbytes) <= SMALL_MAX_SIZE && ALIGN(numbytes) < mmap_threshold) {
+    ptr = small_malloc(arena, ALIGN(numbytes));
+    if(ptr != NULL)
+      return ptr;
+    // run space exhausted, fall back to a chunk
+  }
+
+  numbytes = request_size(numbytes);
+  if(numbytes >= mmap_threshold)
+    return mmap_chunk(numbytes);
+
+  pthread_mutex_lock(&arena->lock);
+  remote_drain(arena);
+  chunk = heap_malloc(arena, numbytes);
+  pthread_mutex_unlock(&arena->lock);
+  return chunk != NULL ? chunk_payload(chunk) : NULL;
+}
+
+void dfree(void *ptr) {
+
+  metadata_t *toFree = NULL;
+  arena_t *arena;
+
+  if(ptr == NULL)
+    return;
+  if(is_small(ptr)) {
+    small_free(ptr);
+    return;
+  }
+  toFree = payload_chunk(ptr);
+
+  if(toFree->size & CHUNK_MMAPPED) {
+    size_t offset = toFree->size & MMAP_OFFSET ? ((size_t *)toFree)[-1] : 0;
+
+    STAT(count_mmap(-(ssize_t)chunk_size(toFree)));
+    munmap((char *)toFree - offset, offset + chunk_size(toFree) + HEADER_SIZE);
+    return;
+  }
+  if((toFree->size & CHUNK_FREE) || chunk_arena(toFree) >= narenas)
+    return;
+
+  // route the chunk back to the arena it was carved from, without
+  // waiting for its lock if another thread owns it
+  arena = &arenas[chunk_arena(toFree)];
+  if(arena != get_arena()) {
+    remote_push(arena, ptr, ptr);
+    return;
+  }
+  pthread_mutex_lock(&arena->lock);
+  heap_release(arena, toFree);
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/* resize_in_place: try to make an arena chunk hold size bytes without
+ * moving it. Shrinking splits off the tail; growing absorbs the following
+ * chunk when it is free (first growing the main arena's break when the
+ * chunk is the last one before it).
+ *   retval: true if the chunk now holds size bytes
+ */
+static bool resize_in_place(metadata_t *chunk, size_t size) {
+  arena_t *arena = &arenas[chunk_arena(chunk)];
+  metadata_t *next;
+  segment_t *top;
+  bool done = false;
+  STAT(size_t old_size = chunk_size(chunk));
+
+  pthread_mutex_lock(&arena->lock);
+  next = next_chunk(chunk);
+  top = arena->segments;
+  if(chunk_size(chunk) < size && chunk_size(next) == 0 && arena->index == 0 &&
+     (char *)top + top->size == (char *)next + HEADER_SIZE && (char *)sbrk(0) == (char *)next + HEADER_SIZE) {
+    // last chunk before the break: grow the heap right behind it
+    size_t want = size - chunk_size(chunk) - HEADER_SIZE;
+    extendH(arena, want < MIN_PAYLOAD ? MIN_PAYLOAD : want);
+  }
+
+  if(chunk_size(chunk) < size && (next->size & CHUNK_FREE) &&
+     chunk_size(chunk) + HEADER_SIZE + chunk_size(next) >= size) {
+    bin_remove(arena, next);
+    set_size(chunk, chunk_size(chunk) + HEADER_SIZE + chunk_size(next));
+    next_chunk(chunk)->size &= ~(size_t)PREV_FREE;
+  }
+
+  if(chunk_size(chunk) >= size) {
+    split_chunk(arena, chunk, size);
+    STAT(count_in_use(arena, (ssize_t)chunk_size(chunk) - (ssize_t)old_size));
+    done = true;
+  }
+  pthread_mutex_unlock(&arena->lock);
+  return done;
+}
+
+/* drealloc: resize an allocation. A small object stays put while its
+ * slot is big enough. mmap'd chunks that stay above the threshold are
+ * resized with mremap, which moves page table entries instead of copying;
+ * arena chunks are resized in place when their neighbour allows it. Only
+ * otherwise is the data copied into a new chunk.
+ */
+void *drealloc(void *ptr, size_t numbytes) {
+  metadata_t *chunk;
+  void *newptr;
+  size_t size;
+
+  // NULL, 0 is dmalloc(0): a minimal block, as dmm.h promises
+  if(ptr == NULL)
+    return dmalloc(numbytes);
+  if(numbytes == 0) {
+    dfree(ptr);
+    return NULL;
+  }
+  if(is_small(ptr)) {
+    size = ptr_run(ptr)->size;
+    if(numbytes <= size && numbytes > size / 2)
+      return ptr;
+    newptr = dmalloc(numbytes);
+    if(newptr == NULL)
+      return numbytes <= size ? ptr : NULL;
+    memcpy(newptr, ptr, size < numbytes ? size : numbytes);
+    dfree(ptr);
+    return newptr;
+  }
+  chunk = payload_chunk(ptr);
+  size = request_size(numbytes);
+
+  if(chunk->size & CHUNK_MMAPPED) {
+#ifdef MREMAP_MAYMOVE
+    // aligned chunks are copied, mremap could move them off the alignment
+    if(size >= mmap_threshold && !(chunk->size & MMAP_OFFSET)) {
+      size_t len = page_round(size);
+
+      STAT(size_t old_size = chunk_size(chunk));
+      chunk = mremap(chunk, chunk_size(chunk) + HEADER_SIZE, len, MREMAP_MAYMOVE);
+      if(chunk == MAP_FAILED)
+        return NULL;
+      STAT(count_mmap((ssize_t)(len - HEADER_SIZE) - (ssize_t)old_size));
+      chunk->size = make_header(len - HEADER_SIZE, 0, CHUNK_MMAPPED);
+      return chunk_payload(chunk);
+    }
+#endif
+  } else if(size < mmap_threshold && resize_in_place(chunk, size)) {
+    return ptr;
+  }
+
+  newptr = dmalloc(numbytes);
+  if(newptr == NULL)
+    return NULL;
+  memcpy(newptr, ptr, chunk_size(chunk) < numbytes ? chunk_size(chunk) : numbytes);
+  dfree(ptr);
+  return newptr;
+}
+
+/* mmap_aligned: map a chunk whose payload is a multiple of alignment.
+ * The pages in front of the chunk header and behind the payload are
+ * unmapped again, only the partial pages around it stay.
+ */
+static void *mmap_aligned(size_t alignment, size_t numbytes) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t len = page_round(numbytes + alignment + SIZE_T_ALIGNED);
+  char *base, *start, *end, *payload;
+  metadata_t *chunk;
+
+  base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(base == MAP_FAILED)
+    return NULL;
+  // leave room for the offset word and the header
+  payload = (char *)(((uintptr_t)base + SIZE_T_ALIGNED + HEADER_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1));
+  chunk = payload_chunk(payload);
+  start = (char *)((uintptr_t)((char *)chunk - SIZE_T_ALIGNED) & ~(uintptr_t)(page - 1));
+  end = (char *)(((uintptr_t)payload + numbytes + page - 1) & ~(uintptr_t)(page - 1));
+  if(start > base)
+    munmap(base, start - base);
+  if(end < base + len)
+    munmap(end, base + len - end);
+
+  ((size_t *)chunk)[-1] = (char *)chunk - start;
+  chunk->size = make_header(end - payload, 0, CHUNK_MMAPPED | MMAP_OFFSET);
+  STAT(count_mmap(chunk_size(chunk)));
+  return payload;
+}
+
+/* dmemalign: allocate numbytes at a multiple of alignment. The arena chunk
+ * is taken big enough that the aligned payload can start at least a
+ * minimal chunk into it; the space in front becomes a free chunk of its
+ * own (coalescing with a free chunk before it) and split_chunk returns the
+ * tail, so nothing of the larger chunk is lost.
+ */
+void *dmemalign(size_t alignment, size_t numbytes) {
+  arena_t *arena;
+  metadata_t *chunk, *aligned;
+  uintptr_t payload;
+  size_t size;
+  void *ptr;
+  STAT(size_t counted);
+
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0)
+    return NULL;
+  if(alignment <= ALIGNMENT)
+    return dmalloc(numbytes);
+
+  if(numbytes == 0)
+    numbytes = 1;
+  arena = get_arena();
+
+  // runs and their headers are aligned, so are slots of a multiple of the alignment
+  size = (numbytes + alignment - 1) & ~(alignment - 1);
+  if(RUN_HEADER_SIZE % alignment == 0 && size <= SMALL_MAX_SIZE && size < mmap_threshold) {
+    ptr = small_malloc(arena, size);
+    if(ptr != NULL)
+      return ptr;
+  }
+
+  size = request_size(numbytes);
+  if(size + alignment >= mmap_threshold)
+    return mmap_aligned(alignment, size);
+
+  pthread_mutex_lock(&arena->lock);
+  remote_drain(arena);
+  chunk = heap_malloc(arena, size + alignment + HEADER_SIZE + MIN_PAYLOAD);
+  if(chunk == NULL) {
+    pthread_mutex_unlock(&arena->lock);
+    return NULL;
+  }
+  STAT(counted = chunk_size(chunk));
+
+  payload = (uintptr_t)chunk_payload(chunk);
+  aligned = chunk;
+  if(payload % alignment != 0) {
+    // the leading fragment must be able to hold a free chunk
+    payload = (payload + HEADER_SIZE + MIN_PAYLOAD + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    aligned = payload_chunk((void *)payload);
+    aligned->size = make_header(chunk_size(chunk) - ((char *)aligned - (char *)chunk), arena->index, 0);
+    set_size(chunk, (char *)aligned - (char *)chunk - HEADER_SIZE);
+    heap_free(arena, chunk);
+    STAT(arena->splits++);
+  }
+  split_chunk(arena, aligned, size);
+  STAT(count_in_use(arena, (ssize_t)chunk_size(aligned) - (ssize_t)counted));
+  pthread_mutex_unlock(&arena->lock);
+  return chunk_payload(aligned);
+}
+
+/* dmalloc_usable_size: how many bytes the caller may actually use at ptr,
+ * which can be more than it asked for.
+ */
+size_t dmalloc_usable_size(void *ptr) {
+  if(ptr == NULL)
+    return 0;
+  if(is_small(ptr))
+    return ptr_run(ptr)->size;
+  return chunk_size(payload_chunk(ptr));
+}
+
+void *dcalloc(size_t nmemb, size_t size) {
+  size_t total;
+  void *ptr;
+
+  if(__builtin_mul_overflow(nmemb, size, &total))
+    return NULL;
+  ptr = dmalloc(total);
+  // fresh mappings are already zero
+  if(ptr != NULL && (is_small(ptr) || !(payload_chunk(ptr)->size & CHUNK_MMAPPED)))
+    memset(ptr, 0, total);
+  return ptr;
+}
+
+/* struct: region_block_t
+ * ---------------
+ * A block a region bumps its allocations out of, a dmalloc'd chunk.
+ * Blocks are linked newest first.
+ */
+struct region_block {
+  struct region_block *next;
+  char *end;
+};
+
+struct dmm_region {
+  region_block_t *head;    // every block, newest first
+  region_block_t *current; // the block being bumped through
+  char *ptr;               // next free byte of current
+  size_t block_size;       // size of the next bump block
+};
+
+#define REGION_HEADER_SIZE (ALIGN(sizeof(region_block_t)))
+
+/* region_block_new: dmalloc a block with size usable bytes and put it at
+ * the head of the region's list
+ */
+static region_block_t *region_block_new(dmm_region_t *region, size_t size) {
+  region_block_t *block = dmalloc(REGION_HEADER_SIZE + size);
+
+  if(block == NULL)
+    return NULL;
+  block->end = (char *)block + REGION_HEADER_SIZE + size;
+  block->next = region->head;
+  region->head = block;
+  return block;
+}
+
+dmm_region_t *dmm_region_create(size_t block_size) {
+  dmm_region_t *region = dmalloc(sizeof(dmm_region_t));
+
+  if(region == NULL)
+    return NULL;
+  region->head = NULL;
+  region->current = NULL;
+  region->ptr = NULL;
+  region->block_size = block_size != 0 ? ALIGN(block_size) : REGION_BLOCK_MIN;
+  return region;
+}
+
+/* dmm_region_alloc: bump numbytes out of the current block. When it is
+ * used up, the next bump block is twice as large (while below REGION_BLOCK_MAX),
+ * so a region needs O(log n) blocks for n bytes. Requests of more than a
+ * quarter of a block get a block of their own and the current one stays.
+ */
+void *dmm_region_alloc(dmm_region_t *region, size_t numbytes) {
+  region_block_t *block;
+  void *ptr;
+
+  assert(numbytes > 0);
+  numbytes = ALIGN(numbytes);
+  if(region->current == NULL || numbytes > (size_t)(region->current->end - region->ptr)) {
+    if(numbytes > region->block_size / 4) {
+      block = region_block_new(region, numbytes);
+      return block != NULL ? (char *)block + REGION_HEADER_SIZE : NULL;
+    }
+    block = region_block_new(region, region->block_size);
+    if(block == NULL)
+      return NULL;
+    if(region->block_size < REGION_BLOCK_MAX)
+      region->block_size *= 2;
+    region->current = block;
+    region->ptr = (char *)block + REGION_HEADER_SIZE;
+  }
+  ptr = region->ptr;
+  region->ptr += numbytes;
+  return ptr;
+}
+
+dmm_region_mark_t dmm_region_save(dmm_region_t *region) {
+  dmm_region_mark_t mark = { region->head, region->current, region->ptr };
+
+  return mark;
+}
+
+/* dmm_region_restore: free everything allocated since mark was saved.
+ * The blocks newer than the mark are exactly those in front of its head.
+ */
+void dmm_region_restore(dmm_region_t *region, dmm_region_mark_t mark) {
+  region_block_t *block, *next;
+
+  for(block = region->head; block != mark.head; block = next) {
+    next = block->next;
+    dfree(block);
+  }
+  region->head = mark.head;
+  region->current = mark.current;
+  region->ptr = mark.ptr;
+}
+
+/* dmm_region_reset: free every object in O(blocks). A region that got by
+ * with one block keeps it. Otherwise all blocks are freed and the next
+ * one is made large enough for everything this round used, so a region
+ * reset once per request soon serves each request from a single block.
+ */
+void dmm_region_reset(dmm_region_t *region) {
+  region_block_t *block, *next;
+  size_t used = 0;
+
+  if(region->head == NULL)
+    return;
+  if(region->head == region->current && region->current->next == NULL) {
+    region->ptr = (char *)region->current + REGION_HEADER_SIZE;
+    return;
+  }
+  for(block = region->head; block != NULL; block = next) {
+    next = block->next;
+    used += block->end - (char *)block - REGION_HEADER_SIZE;
+    dfree(block);
+  }
+  region->head = NULL;
+  region->current = NULL;
+  region->ptr = NULL;
+  if(used > region->block_size)
+    region->block_size = used;
+}
+
+void dmm_region_destroy(dmm_region_t *region) {
+  region_block_t *block, *next;
+
+  for(block = region->head; block != NULL; block = next) {
+    next = block->next;
+    dfree(block);
+  }
+  dfree(region);
+}
+
+/* struct: dhandle
+ * ---------------
+ * What dmalloc_handle returns: where the object is now and how many pins
+ * keep it there, both protected by the owning arena's lock. The first
+ * word of the object's chunk points back to the handle, so compaction
+ * can update ptr after moving the chunk; the caller's bytes follow it.
+ * An object large enough for a mapping of its own never moves and has
+ * arena -1.
+ */
+struct dhandle {
+  void *ptr;
+  int pins;
+  int arena;
+};
+
+#define HANDLE_WORD SIZE_T_ALIGNED
+
+dhandle_t dmalloc_handle(size_t numbytes) {
+  dhandle_t handle;
+  arena_t *arena;
+  metadata_t *chunk;
+  char *payload;
+  size_t size;
+
+  assert(numbytes > 0);
+  handle = dmalloc(sizeof(struct dhandle));
+  if(handle == NULL)
+    return NULL;
+  handle->pins = 0;
+
+  // handle objects never come from the runs: a run slot cannot move
+  size = request_size(numbytes + HANDLE_WORD);
+  if(size >= mmap_threshold) {
+    handle->arena = -1;
+    payload = mmap_chunk(size);
+    if(payload != NULL)
+      handle->ptr = payload + HANDLE_WORD;
+  } else {
+    arena = get_arena();
+    handle->arena = arena->index;
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    chunk = heap_malloc(arena, size);
+    payload = NULL;
+    if(chunk != NULL) {
+      // compaction may move the chunk as soon as the lock is dropped
+      chunk->size |= CHUNK_MOVABLE;
+      payload = chunk_payload(chunk);
+      *(dhandle_t *)payload = handle;
+      handle->ptr = payload + HANDLE_WORD;
+    }
+    pthread_mutex_unlock(&arena->lock);
+  }
+  if(payload == NULL) {
+    dfree(handle);
+    return NULL;
+  }
+  return handle;
+}
+
+void *dhandle_pin(dhandle_t handle) {
+  arena_t *arena;
+  void *ptr;
+
+  if(handle->arena < 0)
+    return handle->ptr;
+  arena = &arenas[handle->arena];
+  pthread_mutex_lock(&arena->lock);
+  handle->pins++;
+  ptr = handle->ptr;
+  pthread_mutex_unlock(&arena->lock);
+  return ptr;
+}
+
+void dhandle_unpin(dhandle_t handle) {
+  arena_t *arena;
+
+  if(handle->arena < 0)
+    return;
+  arena = &arenas[handle->arena];
+  pthread_mutex_lock(&arena->lock);
+  assert(handle->pins > 0);
+  handle->pins--;
+  pthread_mutex_unlock(&arena->lock);
+}
+
+/* dhandle_free: the chunk stops being movable under the arena's lock
+ * before dfree sees it, because a free from another arena's thread
+ * leaves it on the remote stack, linked through its first word, until the
+ * owner drains it.
+ */
+void dhandle_free(dhandle_t handle) {
+  char *payload;
+  arena_t *arena;
+
+  if(handle == NULL)
+    return;
+  if(handle->arena < 0) {
+    dfree((char *)handle->ptr - HANDLE_WORD);
+    dfree(handle);
+    return;
+  }
+  arena = &arenas[handle->arena];
+  pthread_mutex_lock(&arena->lock);
+  assert(handle->pins == 0);
+  payload = (char *)handle->ptr - HANDLE_WORD;
+  payload_chunk(payload)->size &= ~CHUNK_MOVABLE;
+  pthread_mutex_unlock(&arena->lock);
+  dfree(payload);
+  dfree(handle);
+}
+
+/* compact_move: slide the movable chunk right after the free chunk hole
+ * down into the hole's place. The hole ends up behind the chunk, merged
+ * with the free chunk that follows if there is one. Caller holds
+ * arena->lock.
+ *   retval: the moved chunk
+ */
+static metadata_t *compact_move(arena_t *arena, metadata_t *hole)
+{
+  metadata_t *chunk = next_chunk(hole);
+  size_t size = chunk_size(chunk), hole_size = chunk_size(hole);
+  dhandle_t handle = *(dhandle_t *)chunk_payload(chunk);
+
+  bin_remove(arena, hole);
+  memmove(chunk_payload(hole), chunk_payload(chunk), size);
+  // the chunk before the hole was in use, so neither gets PREV_FREE
+  chunk = hole;
+  chunk->size = make_header(size, arena->index, CHUNK_MOVABLE);
+  handle->ptr = (char *)chunk_payload(chunk) + HANDLE_WORD;
+  hole = next_chunk(chunk);
+  hole->size = make_header(hole_size, arena->index, 0);
+  heap_free(arena, hole);
+  STAT(arena->compacted += size);
+  return chunk;
+}
+
+/* compact_arena: one compaction step. Walks the arena's chunks from its
+ * cursor, moving every unpinned handle chunk that follows a free chunk,
+ * until budget bytes have moved or the walk is back where it started
+ * (wrapping from the oldest segment to the newest). Chunk boundaries
+ * change between steps, so the cursor is an offset and the step skips to
+ * the first chunk at or after it. Caller holds arena->lock.
+ *   retval: bytes moved
+ */
+static size_t compact_arena(arena_t *arena, size_t budget)
+{
+  segment_t *seg = arena->compact_seg, *start;
+  size_t off = arena->compact_off, start_off, pos, moved = 0;
+  metadata_t *chunk, *next;
+  bool wrapped = false;
+
+  if(seg == NULL) {
+    seg = arena->segments;
+    off = 0;
+  }
+  start = seg;
+  start_off = off;
+  while(seg != NULL) {
+    chunk = (metadata_t *)((char *)seg + SEGMENT_T_ALIGNED);
+    for(; chunk_size(chunk) != 0; chunk = next_chunk(chunk)) {
+      pos = (char *)chunk - (char *)seg;
+      if(pos < off)
+        continue;
+      if(wrapped && seg == start && pos >= start_off)
+        break;
+      if(moved >= budget) {
+        arena->compact_seg = seg;
+        arena->compact_off = pos;
+        return moved;
+      }
+      next = next_chunk(chunk);
+      if((chunk->size & CHUNK_FREE) && (next->size & (CHUNK_MOVABLE | CHUNK_FREE)) == CHUNK_MOVABLE
+         && (*(dhandle_t *)chunk_payload(next))->pins == 0) {
+        moved += chunk_size(next);
+        chunk = compact_move(arena, chunk);
+      }
+    }
+    if(wrapped && seg == start)
+      break;
+    seg = seg->next;
+    off = 0;
+    if(seg == NULL && !wrapped) {
+      seg = arena->segments;
+      wrapped = true;
+    }
+  }
+  arena->compact_seg = NULL;
+  return moved;
+}
+
+size_t dmalloc_compact(size_t budget) {
+  arena_t *arena;
+  size_t moved = 0;
+  int a;
+
+  for(a = 0; a < narenas; a++) {
+    arena = &arenas[a];
+    pthread_mutex_lock(&arena->lock);
+    remote_drain(arena);
+    moved += compact_arena(arena, budget);
+    pthread_mutex_unlock(&arena->lock);
+  }
+  return moved;
+}
+
+/* struct: persist_header_t
+ * ---------------
+ * The start of a persistent heap file. Chunks follow it back to back up
+ * to an epilogue in the last word of the file, laid out like an arena's.
+ * Every reference into the file is an offset from its start, 0 for none
+ * (the header is at offset 0, so no chunk or payload is).
+ */
+typedef struct persist_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t header_size;   // sizeof(persist_header_t) of the writer
+  size_t file_size;       // bytes of the file, epilogue included
+  size_t root;            // payload offset of the root object
+  size_t bins[NUM_LISTS]; // first free chunk of each size class
+  uint32_t bin_bitmap;
+} persist_header_t;
+
+#define PERSIST_HEAP_START (ALIGN(sizeof(persist_header_t)))
+
+struct dmm_persist {
+  pthread_mutex_t lock;    // the threads of this process
+  int fd;                  // flocked: the other processes
+  char *base;              // the mapping, file offset 0
+  size_t max_size;         // bytes reserved for the mapping
+  persist_header_t *header;
+};
+
+static inline metadata_t *persist_chunk(dmm_persist_t *heap, size_t off)
+{
+  return (metadata_t *)(heap->base + off);
+}
+
+static inline size_t persist_off(dmm_persist_t *heap, metadata_t *chunk)
+{
+  return (char *)chunk - heap->base;
+}
+
+static void persist_bin_insert(dmm_persist_t *heap, metadata_t *chunk)
+{
+  persist_header_t *h = heap->header;
+  int c = size_class(chunk_size(chunk));
+
+  chunk->prev_off = 0;
+  chunk->next_off = h->bins[c];
+  if(h->bins[c] != 0)
+    persist_chunk(heap, h->bins[c])->prev_off = persist_off(heap, chunk);
+  h->bins[c] = persist_off(heap, chunk);
+  h->bin_bitmap |= 1U << c;
+}
+
+static void persist_bin_remove(dmm_persist_t *heap, metadata_t *chunk)
+{
+  persist_header_t *h = heap->header;
+  int c = size_class(chunk_size(chunk));
+
+  if(chunk->prev_off != 0)
+    persist_chunk(heap, chunk->prev_off)->next_off = chunk->next_off;
+  else
+    h->bins[c] = chunk->next_off;
+  if(chunk->next_off != 0)
+    persist_chunk(heap, chunk->next_off)->prev_off = chunk->prev_off;
+  if(h->bins[c] == 0)
+    h->bin_bitmap &= ~(1U << c);
+}
+
+/* persist_free_chunk: coalesce a chunk that is in no bin with its free
+ * neighbours and put the result into its bin
+ */
+static void persist_free_chunk(dmm_persist_t *heap, metadata_t *chunk)
+{
+  metadata_t *next = next_chunk(chunk), *prev;
+
+  if(next->size & CHUNK_FREE) {
+    persist_bin_remove(heap, next);
+    set_size(chunk, chunk_size(chunk) + HEADER_SIZE + chunk_size(next));
+  }
+  if(chunk->size & PREV_FREE) {
+    prev = prev_chunk(chunk);
+    persist_bin_remove(heap, prev);
+    set_size(prev, chunk_size(prev) + HEADER_SIZE + chunk_size(chunk));
+    chunk = prev;
+  }
+  mark_free(chunk);
+  persist_bin_insert(heap, chunk);
+}
+
+/* persist_find_fit: find_fit over the heap's offset bins */
+static metadata_t *persist_find_fit(dmm_persist_t *heap, size_t size)
+{
+  persist_header_t *h = heap->header;
+  int c = size_class(size);
+  size_t off;
+  uint32_t larger;
+
+  for(off = h->bins[c]; off != 0; off = persist_chunk(heap, off)->next_off)
+    if(chunk_size(persist_chunk(heap, off)) >= size)
+      return persist_chunk(heap, off);
+  larger = c + 1 < NUM_LISTS ? h->bin_bitmap & ~((1U << (c + 1)) - 1) : 0;
+  return larger != 0 ? persist_chunk(heap, h->bins[__builtin_ctz(larger)]) : NULL;
+}
+
+/* persist_grow: extend the file so that a free chunk of at least size
+ * bytes ends right before the epilogue, by a quarter of the file but at
+ * least PERSIST_GROW_MIN (up to max_size).
+ *   retval: that chunk, in its bin; NULL if max_size or the disk is full
+ */
+static metadata_t *persist_grow(dmm_persist_t *heap, size_t size)
+{
+  persist_header_t *h = heap->header;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  metadata_t *chunk = persist_chunk(heap, h->file_size - HEADER_SIZE);
+  size_t need, grown;
+
+  // the free chunk before the epilogue becomes part of the new one
+  if(chunk->size & PREV_FREE)
+    chunk = prev_chunk(chunk);
+  need = persist_off(heap, chunk) + 2 * HEADER_SIZE + size;
+  grown = h->file_size + (h->file_size / 4 > PERSIST_GROW_MIN ? h->file_size / 4 : PERSIST_GROW_MIN);
+  if(grown < need)
+    grown = need;
+  grown = (grown + page - 1) & ~(page - 1);
+  if(grown > heap->max_size)
+    grown = heap->max_size;
+  if(grown < need || ftruncate(heap->fd, grown) != 0)
+    return NULL;
+
+  if(chunk->size & CHUNK_FREE)
+    persist_bin_remove(heap, chunk);
+  h->file_size = grown;
+  set_size(chunk, grown - persist_off(heap, chunk) - 2 * HEADER_SIZE);
+  next_chunk(chunk)->size = 0;
+  persist_free_chunk(heap, chunk);
+  return chunk;
+}
+
+/* persist_create: lay out an empty heap in an empty file */
+static bool persist_create(dmm_persist_t *heap)
+{
+  persist_header_t *h = heap->header;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = (PERSIST_GROW_MIN + page - 1) & ~(page - 1);
+  metadata_t *chunk;
+
+  if(size > heap->max_size)
+    size = heap->max_size;
+  if(size < PERSIST_HEAP_START + 2 * HEADER_SIZE + MIN_PAYLOAD || ftruncate(heap->fd, size) != 0)
+    return false;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, PERSIST_MAGIC, sizeof(h->magic));
+  h->version = PERSIST_VERSION;
+  h->header_size = sizeof(persist_header_t);
+  h->file_size = size;
+
+  chunk = persist_chunk(heap, PERSIST_HEAP_START);
+  chunk->size = size - PERSIST_HEAP_START - 2 * HEADER_SIZE;
+  next_chunk(chunk)->size = 0;
+  mark_free(chunk);
+  persist_bin_insert(heap, chunk);
+  return true;
+}
+
+/* persist_check: is the mapped file (file_size bytes) a consistent heap?
+ * Walks every chunk (sizes in bounds, free bits and footers agree, no
+ * two free chunks in a row, the root is a used chunk) and every bin (each
+ * entry is a free chunk of the bin's class, the back links match and the
+ * bins hold exactly the free chunks of the walk).
+ */
+static bool persist_check(dmm_persist_t *heap, size_t file_size)
+{
+  persist_header_t *h = heap->header;
+  size_t off, end, count, nfree = 0, prev_off;
+  bool prev_free = false, root_ok = h->root == 0;
+  metadata_t *chunk;
+  int c;
+
+  if(file_size < PERSIST_HEAP_START + HEADER_SIZE || memcmp(h->magic, PERSIST_MAGIC, sizeof(h->magic)) != 0
+     || h->version != PERSIST_VERSION || h->header_size != sizeof(persist_header_t)
+     || h->file_size != file_size || file_size > heap->max_size || file_size % ALIGNMENT != 0)
+    return false;
+
+  end = file_size - HEADER_SIZE;
+  for(off = PERSIST_HEAP_START; off < end; off += HEADER_SIZE + chunk_size(chunk)) {
+    chunk = persist_chunk(heap, off);
+    if((chunk->size & ~(SIZE_MASK | CHUNK_FREE | PREV_FREE)) != 0 || chunk_size(chunk) < MIN_PAYLOAD
+       || chunk_size(chunk) > end - off - HEADER_SIZE || (chunk->size & PREV_FREE ? 1 : 0) != prev_free)
+      return false;
+    prev_free = chunk->size & CHUNK_FREE;
+    if(prev_free) {
+      if(chunk->size & PREV_FREE || *(size_t *)((char *)next_chunk(chunk) - SIZE_T_ALIGNED) != chunk->size)
+        return false;
+      nfree++;
+    } else if(h->root == off + HEADER_SIZE) {
+      root_ok = true;
+    }
+  }
+  chunk = persist_chunk(heap, end);
+  if(off != end || chunk_size(chunk) != 0 || (chunk->size & ~PREV_FREE) != 0
+     || (chunk->size & PREV_FREE ? 1 : 0) != prev_free || !root_ok)
+    return false;
+
+  count = 0;
+  for(c = 0; c < NUM_LISTS; c++) {
+    if((h->bins[c] != 0) != ((h->bin_bitmap >> c) & 1))
+      return false;
+    prev_off = 0;
+    for(off = h->bins[c]; off != 0; off = chunk->next_off) {
+      chunk = persist_chunk(heap, off);
+      if(off < PERSIST_HEAP_START || off >= end || off % ALIGNMENT != 0
+         || ++count > nfree || !(chunk->size & CHUNK_FREE) || size_class(chunk_size(chunk)) != c
+         || chunk->prev_off != prev_off)
+        return false;
+      prev_off = off;
+    }
+  }
+  return count == nfree;
+}
+
+dmm_persist_t *dmm_persist_open(const char *path, size_t max_size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  dmm_persist_t *heap;
+  struct stat st;
+
+  heap = dmalloc(sizeof(dmm_persist_t));
+  if(heap == NULL)
+    return NULL;
+  heap->max_size = max_size & ~(page - 1);
+  heap->base = MAP_FAILED;
+  heap->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if(heap->fd < 0)
+    goto fail;
+  // wait for any other process to close the heap; the size is only
+  // settled, and an empty file only formatted once, under the lock
+  while(flock(heap->fd, LOCK_EX) != 0)
+    if(errno != EINTR)
+      goto fail;
+  if(fstat(heap->fd, &st) != 0 || (size_t)st.st_size > heap->max_size)
+    goto fail;
+  // the whole reservation is mapped; pages past the end of the file are
+  // only touched once persist_grow has extended it
+  heap->base = mmap(NULL, heap->max_size, PROT_READ | PROT_WRITE, MAP_SHARED, heap->fd, 0);
+  if(heap->base == MAP_FAILED)
+    goto fail;
+  heap->header = (persist_header_t *)heap->base;
+  if(st.st_size == 0 ? !persist_create(heap) : !persist_check(heap, (size_t)st.st_size))
+    goto fail;
+  pthread_mutex_init(&heap->lock, NULL);
+  return heap;
+
+fail:
+  if(heap->base != MAP_FAILED)
+    munmap(heap->base, heap->max_size);
+  if(heap->fd >= 0)
+    close(heap->fd);
+  dfree(heap);
+  return NULL;
+}
+
+void *dmm_persist_alloc(dmm_persist_t *heap, size_t numbytes) {
+  metadata_t *chunk;
+  size_t size;
+
+  if(numbytes == 0 || numbytes > heap->max_size)
+    return NULL;
+  size = request_size(numbytes);
+  pthread_mutex_lock(&heap->lock);
+  chunk = persist_find_fit(heap, size);
+  if(chunk == NULL)
+    chunk = persist_grow(heap, size);
+  if(chunk == NULL) {
+    pthread_mutex_unlock(&heap->lock);
+    return NULL;
+  }
+  persist_bin_remove(heap, chunk);
+  mark_used(chunk);
+  if(chunk_size(chunk) >= size + HEADER_SIZE + MIN_PAYLOAD) {
+    metadata_t *rest;
+    size_t total = chunk_size(chunk);
+
+    set_size(chunk, size);
+    rest = next_chunk(chunk);
+    rest->size = total - size - HEADER_SIZE;
+    persist_free_chunk(heap, rest);
+  }
+  pthread_mutex_unlock(&heap->lock);
+  return chunk_payload(chunk);
+}
+
+void dmm_persist_free(dmm_persist_t *heap, void *ptr) {
+  if(ptr == NULL)
+    return;
+  pthread_mutex_lock(&heap->lock);
+  if(heap->header->root == dmm_persist_offset(heap, ptr))
+    heap->header->root = 0;
+  persist_free_chunk(heap, payload_chunk(ptr));
+  pthread_mutex_unlock(&heap->lock);
+}
+
+void *dmm_persist_root(dmm_persist_t *heap) {
+  return dmm_persist_ptr(heap, heap->header->root);
+}
+
+void dmm_persist_set_root(dmm_persist_t *heap, void *ptr) {
+  pthread_mutex_lock(&heap->lock);
+  heap->header->root = dmm_persist_offset(heap, ptr);
+  pthread_mutex_unlock(&heap->lock);
+}
+
+size_t dmm_persist_offset(dmm_persist_t *heap, void *ptr) {
+  return ptr != NULL ? (size_t)((char *)ptr - heap->base) : 0;
+}
+
+void *dmm_persist_ptr(dmm_persist_t *heap, size_t offset) {
+  return offset != 0 ? heap->base + offset : NULL;
+}
+
+bool dmm_persist_sync(dmm_persist_t *heap) {
+  bool ok;
+
+  pthread_mutex_lock(&heap->lock);
+  ok = msync(heap->base, heap->header->file_size, MS_SYNC) == 0;
+  pthread_mutex_unlock(&heap->lock);
+  return ok;
+}
+
+void dmm_persist_close(dmm_persist_t *heap) {
+  munmap(heap->base, heap->max_size);
+  flock(heap->fd, LOCK_UN);
+  close(heap->fd);
+  pthread_mutex_destroy(&heap->lock);
+  dfree(heap);
+}
+
+/* dmalloc_prefork: take every arena lock, in index order like any other
+ * code that holds more than one, so no chunk is mid-update at fork time.
+ */
+void dmalloc_prefork() {
+  int i;
+
+  for(i = 0; i < MAX_ARENAS; i++)
+    pthread_mutex_lock(&arenas[i].lock);
+  pthread_mutex_lock(&run_lock);
+}
+
+void dmalloc_postfork_parent() {
+  int i;
+
+  pthread_mutex_unlock(&run_lock);
+  for(i = MAX_ARENAS - 1; i >= 0; i--)
+    pthread_mutex_unlock(&arenas[i].lock);
+}
+
+/* dmalloc_postfork_child: the child only has the forking thread, which
+ * owns every lock; start them over. Chunks cached by the other threads
+ * of the parent are lost to the child.
+ */
+void dmalloc_postfork_child() {
+  int i;
+
+  for(i = 0; i < MAX_ARENAS; i++)
+    pthread_mutex_init(&arenas[i].lock, NULL);
+  pthread_mutex_init(&run_lock, NULL);
+}
+
+/* dmalloc_stats: snapshot of the allocator counters. Takes each arena's
+ * lock in turn, so the numbers of different arenas are not from exactly
+ * the same moment.
+ */
+void dmalloc_stats(dmalloc_stats_t *stats) {
+  memset(stats, 0, sizeof(*stats));
+#ifndef DMM_NO_STATS
+  metadata_t *chunk;
+  arena_t *arena;
+  int a, i;
+
+  stats->in_use = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+  stats->peak_in_use = __atomic_load_n(&peak_mmap_bytes, __ATOMIC_RELAXED);
+  for(a = 0; a < narenas; a++) {
+    arena = &arenas[a];
+    pthread_mutex_lock(&arena->lock);
+    stats->in_use += arena->in_use;
+    stats->peak_in_use += arena->peak_in_use;
+    stats->heap_size += arena->heap_bytes;
+    stats->peak_heap_size += arena->peak_heap_bytes;
+    stats->free_blocks += arena->free_blocks;
+    stats->sbrk_grows += arena->sbrk_grows;
+    stats->region_maps += arena->region_maps;
+    stats->splits += arena->splits;
+    stats->coalesces += arena->coalesces;
+    stats->trimmed += arena->trimmed;
+    stats->madvised += arena->madvised;
+    stats->remote_frees += arena->remote_frees;
+    stats->compacted += arena->compacted;
+    for(i = 0; i < DMM_FIT_HIST; i++)
+      stats->fit_hist[i] += arena->fit_hist[i];
+    // the largest free chunk is in the highest non-empty bin
+    if(arena->bin_bitmap != 0) {
+      i = 31 - __builtin_clz(arena->bin_bitmap);
+      for(chunk = arena->bins[i]; chunk != NULL; chunk = chunk->next_free)
+        if(chunk_size(chunk) > stats->largest_free)
+          stats->largest_free = chunk_size(chunk);
+    }
+    pthread_mutex_unlock(&arena->lock);
+  }
+#endif
+}
+
+/* for debugging; can be turned off through -NDEBUG flag*/
+void print_freelist() {
+  metadata_t *freelist_head;
+  segment_t *seg;
+  int a, i;
+
+  for(a = 0; a < narenas; a++) {
+    for(seg = arenas[a].segments; seg != NULL; seg = seg->next) {
+      DEBUG("arena %d segment %p, %zd bytes", a, seg, seg->size);
+      freelist_head = (metadata_t *)((char *)seg + SEGMENT_T_ALIGNED);
+      while(chunk_size(freelist_head) != 0) {
+        DEBUG("\tchunk Size:%zd, Head:%p, Free:%d\t",
+	      chunk_size(freelist_head),
+	      freelist_head,
+	      (int)(freelist_head->size & CHUNK_FREE));
+        freelist_head = next_chunk(freelist_head);
+      }
+    }
+    for(i = 0; i < NUM_LISTS; i++) {
+      for(freelist_head = arenas[a].bins[i]; freelist_head != NULL; freelist_head = freelist_head->next_free)
+        DEBUG("\tbin %d Size:%zd, Head:%p", i, chunk_size(freelist_head), freelist_head);
+    }
   }
   DEBUG("\n");
 }
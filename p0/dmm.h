@@ -1,29 +1,63 @@
 #ifndef __CPS310_MM_H__
 #define __CPS310_MM_H__
 
+#include <stddef.h> // needed for size_t
 
-/* You do not need to change MAX_HEAP_SIZE 
+
+/* MAX_HEAP_SIZE is the default initial size of the main heap, which
+ * grows at run time as needed. DMM_HEAP_SIZE or dmalloc_init_heap()
+ * override it without recompiling; the test_stress drivers size their
+ * requests from it.
  */
-//#define MAX_HEAP_SIZE	(1024*1024*32) /* max size restricted to 32 MB */
-//#define MAX_HEAP_SIZE	(1024*1024*4) /* max size restricted to 4MB, recommended setting for test_stress2 */
-#define MAX_HEAP_SIZE	(1024) /* max size restricted to 1kB*/
+//#define MAX_HEAP_SIZE	(1024*1024*32) /* 32 MB */
+//#define MAX_HEAP_SIZE	(1024*1024*4) /* 4MB, recommended setting for test_stress2 */
+#ifndef MAX_HEAP_SIZE
+#define MAX_HEAP_SIZE	(1024) /* 1kB */
+#endif
 
 
 /* struct: metadata_t
  * ---------------
- * A header that comes before each chunk of memory that
- * contains the size of the memory and whether or not
- * that memory is free.
+ * A header that comes before each chunk of memory. An allocated chunk
+ * only carries the size word: the payload size with the status bits
+ * below packed into its low 3 bits (payload sizes are multiples of 8) and
+ * the owning arena in its top byte. A free chunk additionally keeps its
+ * size-class bin links in the first two words of its payload and a copy
+ * of the size word (the boundary tag) in its last word, so the chunk
+ * after it can find its start when coalescing. In a persistent heap
+ * (dmm_persist_open) the links are offsets from the start of the file, so
+ * the heap is valid wherever the file is mapped.
  */
 typedef struct metadata {
   size_t size;
-  int available;
-  struct metadata *next;
-  struct metadata *prev;
-  char end[1]; 
+  union { // only valid while the chunk is free
+    struct metadata *next_free;
+    size_t next_off;
+  };
+  union {
+    struct metadata *prev_free;
+    size_t prev_off;
+  };
 } metadata_t;
 
 
+/* status bits in metadata_t.size */
+#define CHUNK_FREE	0x1 /* this chunk is free */
+#define PREV_FREE	0x2 /* the chunk right before this one is free (its footer is valid) */
+#define CHUNK_MMAPPED	0x4 /* allocation that has its own mmap'd region */
+#define STATUS_MASK	0x7
+/* an mmap'd chunk never has a free neighbour, so PREV_FREE is reused:
+ * the chunk does not start its mapping and the word in front of its
+ * header holds the distance back to the start (see dmemalign) */
+#define MMAP_OFFSET	PREV_FREE
+
+/* the owning arena's index lives in the top byte of the size word, the
+ * bit below it marks a handle's chunk, which dmalloc_compact may move */
+#define ARENA_SHIFT	56
+#define CHUNK_MOVABLE	(((size_t)1) << (ARENA_SHIFT - 1))
+#define SIZE_MASK	(CHUNK_MOVABLE - 1 - STATUS_MASK)
+
+
 /* On 32-bit machines, change this to 4 */
 #define WORD_SIZE	8
 
@@ -36,7 +70,11 @@ typedef struct metadata {
 
 #define SIZE_T_ALIGNED (ALIGN(sizeof(size_t)))
 
-#define METADATA_T_ALIGNED (ALIGN(sizeof(metadata_t)))
+/* bytes of header in front of each payload */
+#define HEADER_SIZE SIZE_T_ALIGNED
+
+/* a free chunk must have room for next_free, prev_free and its footer */
+#define MIN_PAYLOAD (2*sizeof(metadata_t *) + SIZE_T_ALIGNED)
 
 #ifdef NDEBUG
 	#define DEBUG(M, ...)
@@ -47,13 +85,160 @@ typedef struct metadata {
 #endif
 
 
+#ifdef __cplusplus
+/* C++ callers (dmm_allocator.h) use their own bool; the enum's values
+ * are 0 and 1, so returned values read the same */
+extern "C" {
+#else
 typedef enum{false, true} bool;
+#endif
 
 bool dmalloc_init();
+/* set up the main heap with an initial size of bytes; false if the heap
+ * already exists or the memory is not available */
+bool dmalloc_init_heap(size_t bytes);
+/* numbytes 0 gets a minimal block, not NULL */
 void *dmalloc(size_t numbytes);
 void dfree(void *allocptr);
-
+/* allocptr NULL is dmalloc(numbytes), even for 0; numbytes 0 otherwise
+ * frees allocptr and returns NULL */
+void *drealloc(void *allocptr, size_t numbytes);
+/* zeroed array of nmemb elements of size bytes; NULL if the product
+ * overflows, a minimal block like dmalloc(0) if it is 0 */
+void *dcalloc(size_t nmemb, size_t size);
+/* numbytes at a multiple of alignment (a power of two), NULL otherwise */
+void *dmemalign(size_t alignment, size_t numbytes);
+/* bytes actually usable at allocptr (at least what was requested) */
+size_t dmalloc_usable_size(void *allocptr);
+/* requests of at least this many bytes are served by mmap (default 128KB) */
+void dmalloc_set_mmap_threshold(size_t bytes);
+/* free space of at least this many bytes is given back to the OS (default 128KB) */
+void dmalloc_set_trim_threshold(size_t bytes);
+/* give free memory back to the OS, keeping pad bytes free at the top of
+ * the main heap; 1 if anything was released */
+int dmalloc_trim(size_t pad);
+
+
+/* find_fit calls by number of chunks examined: 0, 1, 2-3, 4-7, ..., 64+ */
+#define DMM_FIT_HIST	8
+
+/* struct: dmalloc_stats_t
+ * ---------------
+ * Counters filled in by dmalloc_stats. in_use counts chunk payloads
+ * handed out of the arenas, small-object slots and mmap'd chunks, so
+ * objects sitting in a thread's cache count as in use. heap_size counts
+ * the arena segments and small-object runs, not mmap'd chunks. The
+ * counters are kept per arena, so the peaks are the sums of each arena's
+ * peak: an upper bound when the arenas peak at different times.
+ * Everything is zero when dmm.c is built with -DDMM_NO_STATS.
+ */
+typedef struct dmalloc_stats {
+  size_t in_use;        /* bytes currently allocated */
+  size_t peak_in_use;   /* most bytes allocated at the same time */
+  size_t heap_size;     /* bytes of segments and runs */
+  size_t peak_heap_size;/* largest heap_size so far */
+  size_t free_blocks;   /* free chunks in all bins */
+  size_t largest_free;  /* payload size of the largest free chunk */
+  size_t sbrk_grows;    /* times the main arena moved the break */
+  size_t region_maps;   /* regions mmap'd for the other arenas */
+  size_t splits;        /* chunks split in two */
+  size_t coalesces;     /* free chunks merged with a neighbour */
+  size_t trimmed;       /* bytes given back by moving the break down */
+  size_t madvised;      /* bytes of free chunks given back with madvise */
+  size_t remote_frees;  /* objects freed by another arena's thread and
+                           drained by the owner */
+  size_t compacted;     /* bytes of handle objects moved by dmalloc_compact */
+  size_t fit_hist[DMM_FIT_HIST];
+} dmalloc_stats_t;
+
+void dmalloc_stats(dmalloc_stats_t *stats);
+
+/* Regions: request-scoped pointer-bump allocation out of blocks taken
+ * from dmalloc. Objects are never freed one by one; dmm_region_reset
+ * frees all of them (a region that needed a single block keeps it) and
+ * dmm_region_destroy also frees the region. dmm_region_save/dmm_region_restore give nested
+ * scopes: restoring a mark frees everything allocated since it was
+ * saved. A reset invalidates all marks. A region is not thread-safe.
+ */
+typedef struct region_block region_block_t;
+typedef struct dmm_region dmm_region_t;
+typedef struct dmm_region_mark {
+  region_block_t *head;
+  region_block_t *current;
+  char *ptr;
+} dmm_region_mark_t;
+
+/* block_size 0 picks the default (4kB) */
+dmm_region_t *dmm_region_create(size_t block_size);
+void *dmm_region_alloc(dmm_region_t *region, size_t numbytes);
+dmm_region_mark_t dmm_region_save(dmm_region_t *region);
+void dmm_region_restore(dmm_region_t *region, dmm_region_mark_t mark);
+void dmm_region_reset(dmm_region_t *region);
+void dmm_region_destroy(dmm_region_t *region);
+
+/* Handles: movable allocations for long-running programs whose heap
+ * fragments. dmalloc_handle returns a handle, not an address.
+ * dhandle_pin gives the object's current address and keeps the object
+ * there until the matching dhandle_unpin; pins nest. Unpinned objects
+ * may be moved by dmalloc_compact, which slides them down over the free
+ * chunks in front of them. The free space then gathers into large chunks
+ * behind them. Handle objects are freed with dhandle_free only, never
+ * with dfree, and are never resized.
+ */
+typedef struct dhandle *dhandle_t;
+
+dhandle_t dmalloc_handle(size_t numbytes);
+void *dhandle_pin(dhandle_t handle);
+void dhandle_unpin(dhandle_t handle);
+void dhandle_free(dhandle_t handle);
+/* one incremental compaction step: move up to budget bytes of unpinned
+ * handle objects per arena, resuming where the last step stopped;
+ *   retval: bytes moved, 0 once a whole pass found nothing to move */
+size_t dmalloc_compact(size_t budget);
+
+/* Persistent heaps: a heap that lives in a file mapped with MAP_SHARED.
+ * Its bins, its free chunks' links and its root are offsets from the
+ * start of the file. A process that opens the file again has the free
+ * lists and the root object back at once, wherever the file is mapped.
+ * Objects that point to each other should store dmm_persist_offset
+ * values too. dmm_persist_open checks the whole heap and fails (NULL) if
+ * the file is not a consistent heap. Every operation that has returned
+ * is in the file, because the mapping is shared, so a process that
+ * crashes loses nothing. dmm_persist_sync writes the file to disk, so the
+ * heap also survives a crash of the machine. Operations on one heap are
+ * serialized by its lock, which only the threads of one process share:
+ * dmm_persist_open also takes flock(LOCK_EX) on the file and waits while
+ * another process has it open, until that one closes it or exits. A
+ * child forked with the heap open shares the flock and must not use it.
+ */
+typedef struct dmm_persist dmm_persist_t;
+
+/* map path, creating the file if it is empty or missing, with room for
+ * the heap to grow to max_size bytes */
+dmm_persist_t *dmm_persist_open(const char *path, size_t max_size);
+void *dmm_persist_alloc(dmm_persist_t *heap, size_t numbytes);
+void dmm_persist_free(dmm_persist_t *heap, void *ptr);
+/* the object a reopened heap starts from, NULL until one is set */
+void *dmm_persist_root(dmm_persist_t *heap);
+void dmm_persist_set_root(dmm_persist_t *heap, void *ptr);
+/* offsets for links between objects; 0 is NULL */
+size_t dmm_persist_offset(dmm_persist_t *heap, void *ptr);
+void *dmm_persist_ptr(dmm_persist_t *heap, size_t offset);
+/* msync the heap; false if the kernel reports an error */
+bool dmm_persist_sync(dmm_persist_t *heap);
+/* unmap the heap without syncing it */
+void dmm_persist_close(dmm_persist_t *heap);
+
+/* fork handlers (pthread_atfork): hold every arena lock across fork so
+ * the child never inherits a heap that another thread was changing */
+void dmalloc_prefork();
+void dmalloc_postfork_parent();
+void dmalloc_postfork_child();
 
 void print_freelist(); /* optional for debugging */
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* end of __CPS310_MM_H__ */
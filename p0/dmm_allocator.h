@@ -0,0 +1,218 @@
+/*
+ * dmm_allocator.h -- C++ allocators and memory resources over dmm
+ *
+ *   dmm_allocator<T>       standard allocator, every allocation is a
+ *                          dmalloc (dmemalign for over-aligned types)
+ *   dmm_pool_allocator<T>  standard allocator for node-based containers
+ *                          (map, set, list): single objects come from a
+ *                          per-thread free list of T-sized nodes carved
+ *                          out of dmalloc'd chunks, so inserting and
+ *                          erasing nodes stops reaching dmalloc once the
+ *                          pool is warm; arrays go to dmalloc
+ *   dmm_memory_resource    std::pmr::memory_resource over dmalloc; wrap it
+ *                          in a std::pmr::unsynchronized_pool_resource for
+ *                          pooled pmr containers
+ *   dmm_region_resource    std::pmr::memory_resource over a dmm region:
+ *                          deallocate does nothing, release() frees all
+ *
+ * The pmr classes need C++17, the rest C++11. Link with dmm.o.
+ *
+ * The node pools never give memory back to dmalloc: a pool stays as large
+ * as the most nodes of its type its thread had at once. A node freed by
+ * another thread joins that thread's free list.
+ *
+ * Not safe under preemptive user-level threads (p1t's start_preemptions):
+ * the calls go straight to dmalloc, not through the interrupt library's
+ * wrapped malloc/new, and green threads on one kernel thread share its
+ * caches, its pool free lists and the arena locks. A thread preempted
+ * halfway through a free list update, or holding an arena lock that the
+ * next thread then waits on, corrupts the list or deadlocks.
+ */
+#ifndef __CPS310_DMM_ALLOCATOR_H__
+#define __CPS310_DMM_ALLOCATOR_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "dmm.h"
+
+namespace dmm_detail {
+
+// bytes at alignment from dmalloc, bad_alloc if there are none
+inline void *allocate(size_t bytes, size_t alignment) {
+  void *p;
+
+  if(bytes == 0)
+    bytes = 1;
+  p = alignment > ALIGNMENT ? dmemalign(alignment, bytes) : dmalloc(bytes);
+  if(p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+template <class T>
+inline T *allocate_array(size_t n) {
+  if(n > (size_t)-1 / sizeof(T))
+    throw std::bad_alloc();
+  return static_cast<T *>(allocate(n * sizeof(T), alignof(T)));
+}
+
+} // namespace dmm_detail
+
+template <class T>
+class dmm_allocator {
+ public:
+  typedef T value_type;
+
+  dmm_allocator() noexcept {}
+  template <class U>
+  dmm_allocator(const dmm_allocator<U> &) noexcept {}
+
+  T *allocate(size_t n) {
+    return dmm_detail::allocate_array<T>(n);
+  }
+  void deallocate(T *p, size_t) noexcept {
+    dfree(p);
+  }
+};
+
+template <class T, class U>
+inline bool operator==(const dmm_allocator<T> &, const dmm_allocator<U> &) {
+  return true;
+}
+template <class T, class U>
+inline bool operator!=(const dmm_allocator<T> &, const dmm_allocator<U> &) {
+  return false;
+}
+
+template <class T>
+class dmm_pool_allocator {
+  // a free node holds the link, a used one the object
+  union node {
+    node *next;
+    alignas(T) unsigned char object[sizeof(T)];
+  };
+
+  // a pool chunk is about a page of nodes
+  static const size_t NODES_PER_CHUNK = sizeof(node) >= 4096 ? 1 : 4096 / sizeof(node);
+
+  static thread_local node *free_list_;
+
+  // carve a new chunk into nodes and put them on the free list
+  static void refill() {
+    node *chunk = dmm_detail::allocate_array<node>(NODES_PER_CHUNK);
+
+    for(size_t i = 0; i < NODES_PER_CHUNK; i++) {
+      chunk[i].next = free_list_;
+      free_list_ = &chunk[i];
+    }
+  }
+
+ public:
+  typedef T value_type;
+
+  dmm_pool_allocator() noexcept {}
+  template <class U>
+  dmm_pool_allocator(const dmm_pool_allocator<U> &) noexcept {}
+
+  T *allocate(size_t n) {
+    node *b;
+
+    if(n != 1)
+      return dmm_detail::allocate_array<T>(n);
+    if(free_list_ == NULL)
+      refill();
+    b = free_list_;
+    free_list_ = b->next;
+    return reinterpret_cast<T *>(b);
+  }
+  void deallocate(T *p, size_t n) noexcept {
+    node *b = reinterpret_cast<node *>(p);
+
+    if(n != 1) {
+      dfree(p);
+      return;
+    }
+    b->next = free_list_;
+    free_list_ = b;
+  }
+};
+
+template <class T>
+thread_local typename dmm_pool_allocator<T>::node *dmm_pool_allocator<T>::free_list_ = NULL;
+
+template <class T, class U>
+inline bool operator==(const dmm_pool_allocator<T> &, const dmm_pool_allocator<U> &) {
+  return true;
+}
+template <class T, class U>
+inline bool operator!=(const dmm_pool_allocator<T> &, const dmm_pool_allocator<U> &) {
+  return false;
+}
+
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+#include <memory_resource>
+
+class dmm_memory_resource : public std::pmr::memory_resource {
+ protected:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    return dmm_detail::allocate(bytes, alignment);
+  }
+  void do_deallocate(void *p, size_t, size_t) override {
+    dfree(p);
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return dynamic_cast<const dmm_memory_resource *>(&other) != NULL;
+  }
+};
+
+// one resource for the whole process; all instances are interchangeable
+inline dmm_memory_resource *dmm_resource() {
+  static dmm_memory_resource resource;
+  return &resource;
+}
+
+// Like std::pmr::monotonic_buffer_resource, with the buffer a dmm region.
+class dmm_region_resource : public std::pmr::memory_resource {
+  dmm_region_t *region_;
+
+ public:
+  // block_size 0 picks the region default
+  explicit dmm_region_resource(size_t block_size = 0)
+    : region_(dmm_region_create(block_size)) {
+    if(region_ == NULL)
+      throw std::bad_alloc();
+  }
+  ~dmm_region_resource() override {
+    dmm_region_destroy(region_);
+  }
+  dmm_region_resource(const dmm_region_resource &) = delete;
+  dmm_region_resource &operator=(const dmm_region_resource &) = delete;
+
+  // free everything allocated so far
+  void release() {
+    dmm_region_reset(region_);
+  }
+  dmm_region_t *region() const {
+    return region_;
+  }
+
+ protected:
+  void *do_allocate(size_t bytes, size_t alignment) override {
+    size_t extra = alignment > ALIGNMENT ? alignment - ALIGNMENT : 0;
+    char *p = static_cast<char *>(dmm_region_alloc(region_, bytes + extra));
+
+    if(p == NULL)
+      throw std::bad_alloc();
+    return p + (-(uintptr_t)p & (alignment - 1));
+  }
+  void do_deallocate(void *, size_t, size_t) override {
+  }
+  bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+    return this == &other;
+  }
+};
+#endif
+
+#endif /* end of __CPS310_DMM_ALLOCATOR_H__ */
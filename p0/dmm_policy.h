@@ -0,0 +1,338 @@
+/*
+ * dmm_policy.h -- header-only C++ heap with compile-time policies
+ *
+ * dmm.c fixes its placement (first fit inside power-of-two bins) and
+ * splits whenever the rest can hold a minimal chunk. policy_heap makes
+ * those choices template parameters, so each instantiation is compiled
+ * (and inlined) for one combination and combinations can be compared on
+ * the same trace (see policy_bench.cc):
+ *
+ *   dmm::policy_heap<Placement, SmallestCuttable, AcceptablePercent, Alignment>
+ *
+ *   Placement          first_fit, next_fit, best_fit or segregated_fit
+ *   SmallestCuttable   a split must leave a block of at least this many
+ *                      bytes (dmm.c's SMALLEST_CUTTABLE_CHUNK)
+ *   AcceptablePercent  split only if the request uses at most this percent
+ *                      of the block (dmm.c's ACCEPTABLE_FRACTION, as a
+ *                      percentage); 100 splits whenever the rest is cuttable
+ *   Alignment          payload alignment, a power of two of at least 8
+ *
+ * Blocks use dmm.c's boundary tags: one header word (block size, FREE and
+ * PREV_FREE bits), free blocks keep their list links at the start of the
+ * payload and a copy of the header in their last word. The heap lives in
+ * a buffer given to the constructor and grows through it like a break;
+ * heap_size() is how far it has grown. Needs C++11; not thread-safe.
+ */
+#ifndef __CPS310_DMM_POLICY_H__
+#define __CPS310_DMM_POLICY_H__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace dmm {
+
+// Block layout for one alignment; every placement policy is written
+// against it.
+template <size_t Alignment>
+struct block_layout {
+  static_assert(Alignment >= sizeof(size_t) && (Alignment & (Alignment - 1)) == 0,
+                "Alignment must be a power of two of at least a word");
+
+  static const size_t FREE = 0x1;
+  static const size_t PREV_FREE = 0x2;
+  // the header is padded so the payload after it stays aligned
+  static const size_t header = Alignment;
+  static const size_t min_block =
+    (header + 2 * sizeof(char *) + sizeof(size_t) + Alignment - 1) & ~(Alignment - 1);
+
+  static size_t round(size_t n) {
+    return (n + Alignment - 1) & ~(Alignment - 1);
+  }
+  static size_t &word(char *b) {
+    return *reinterpret_cast<size_t *>(b);
+  }
+  static size_t size(char *b) {
+    return word(b) & ~(Alignment - 1);
+  }
+  static bool is_free(char *b) {
+    return word(b) & FREE;
+  }
+  static char *&next(char *b) {
+    return *reinterpret_cast<char **>(b + header);
+  }
+  static char *&prev(char *b) {
+    return *reinterpret_cast<char **>(b + header + sizeof(char *));
+  }
+  static char *following(char *b) {
+    return b + size(b);
+  }
+  // only valid when b->PREV_FREE is set
+  static char *preceding(char *b) {
+    return b - (*reinterpret_cast<size_t *>(b - sizeof(size_t)) & ~(Alignment - 1));
+  }
+  static void set_footer(char *b) {
+    *reinterpret_cast<size_t *>(b + size(b) - sizeof(size_t)) = word(b);
+  }
+};
+
+// Unlink b from a doubly linked list whose head is head.
+template <class L>
+inline void list_remove(char *&head, char *b) {
+  if(L::prev(b) != NULL)
+    L::next(L::prev(b)) = L::next(b);
+  else
+    head = L::next(b);
+  if(L::next(b) != NULL)
+    L::prev(L::next(b)) = L::prev(b);
+}
+
+template <class L>
+inline void list_push(char *&head, char *b) {
+  L::prev(b) = NULL;
+  L::next(b) = head;
+  if(head != NULL)
+    L::prev(head) = b;
+  head = b;
+}
+
+// First fit: one LIFO free list, the first block that is large enough.
+template <class L>
+class first_fit {
+  char *head_;
+ public:
+  first_fit() : head_(NULL) {}
+  void insert(char *b) { list_push<L>(head_, b); }
+  void remove(char *b) { list_remove<L>(head_, b); }
+  char *find(size_t size) {
+    for(char *b = head_; b != NULL; b = L::next(b))
+      if(L::size(b) >= size)
+        return b;
+    return NULL;
+  }
+};
+
+// Next fit: like first fit, but each search starts where the last one
+// stopped (the roving pointer) and wraps around once.
+template <class L>
+class next_fit {
+  char *head_;
+  char *rover_;
+ public:
+  next_fit() : head_(NULL), rover_(NULL) {}
+  void insert(char *b) { list_push<L>(head_, b); }
+  void remove(char *b) {
+    if(rover_ == b)
+      rover_ = L::next(b);
+    list_remove<L>(head_, b);
+  }
+  char *find(size_t size) {
+    char *start = rover_ != NULL ? rover_ : head_;
+    char *b;
+
+    for(b = start; b != NULL; b = L::next(b))
+      if(L::size(b) >= size)
+        return rover_ = b;
+    for(b = head_; b != start; b = L::next(b))
+      if(L::size(b) >= size)
+        return rover_ = b;
+    return NULL;
+  }
+};
+
+// Best fit: the smallest block that is large enough, searching the
+// whole list unless a block fits exactly.
+template <class L>
+class best_fit {
+  char *head_;
+ public:
+  best_fit() : head_(NULL) {}
+  void insert(char *b) { list_push<L>(head_, b); }
+  void remove(char *b) { list_remove<L>(head_, b); }
+  char *find(size_t size) {
+    char *best = NULL;
+
+    for(char *b = head_; b != NULL; b = L::next(b)) {
+      if(L::size(b) == size)
+        return b;
+      if(L::size(b) > size && (best == NULL || L::size(b) < L::size(best)))
+        best = b;
+    }
+    return best;
+  }
+};
+
+// Segregated fit: dmm.c's policy. One list per power-of-two size class
+// and a bitmap of the non-empty ones; first fit in the request's class,
+// otherwise the head of the next non-empty larger class.
+template <class L>
+class segregated_fit {
+  static const int NUM_CLASSES = 48;
+  char *bins_[NUM_CLASSES];
+  uint64_t bitmap_;
+
+  static int size_class(size_t size) {
+    int c = 63 - __builtin_clzll(size) - 3;
+    return c < 0 ? 0 : (c >= NUM_CLASSES ? NUM_CLASSES - 1 : c);
+  }
+ public:
+  segregated_fit() : bitmap_(0) {
+    for(int i = 0; i < NUM_CLASSES; i++)
+      bins_[i] = NULL;
+  }
+  void insert(char *b) {
+    int c = size_class(L::size(b));
+
+    list_push<L>(bins_[c], b);
+    bitmap_ |= (uint64_t)1 << c;
+  }
+  void remove(char *b) {
+    int c = size_class(L::size(b));
+
+    list_remove<L>(bins_[c], b);
+    if(bins_[c] == NULL)
+      bitmap_ &= ~((uint64_t)1 << c);
+  }
+  char *find(size_t size) {
+    int c = size_class(size);
+    uint64_t larger;
+
+    for(char *b = bins_[c]; b != NULL; b = L::next(b))
+      if(L::size(b) >= size)
+        return b;
+    larger = c + 1 < NUM_CLASSES ? bitmap_ & ~(((uint64_t)1 << (c + 1)) - 1) : 0;
+    return larger != 0 ? bins_[__builtin_ctzll(larger)] : NULL;
+  }
+};
+
+template <template <class> class Placement,
+          size_t SmallestCuttable = 32,
+          unsigned AcceptablePercent = 100,
+          size_t Alignment = 8>
+class policy_heap {
+  typedef block_layout<Alignment> L;
+
+  char *base_;  // first block
+  char *top_;   // epilogue header, the break of this heap
+  char *limit_; // end of the buffer
+  Placement<L> index_;
+
+  // cut b down to size if the policy allows it and free the rest
+  void place(char *b, size_t size) {
+    size_t total = L::size(b);
+    size_t rest = total - size;
+    char *next;
+
+    if(rest >= L::min_block && rest >= SmallestCuttable &&
+       size * 100 <= total * AcceptablePercent) {
+      L::word(b) = size | (L::word(b) & L::PREV_FREE);
+      next = L::following(b);
+      L::word(next) = rest;
+      free_block(next);
+      return;
+    }
+    L::word(b) &= ~L::FREE;
+    L::word(L::following(b)) &= ~L::PREV_FREE;
+  }
+
+  // mark b free, merge it with free neighbours and index the result
+  void free_block(char *b) {
+    char *next = L::following(b);
+
+    if(L::is_free(next)) {
+      index_.remove(next);
+      L::word(b) += L::size(next);
+    }
+    if(L::word(b) & L::PREV_FREE) {
+      char *prev = L::preceding(b);
+
+      index_.remove(prev);
+      L::word(prev) += L::size(b);
+      b = prev;
+    }
+    L::word(b) |= L::FREE;
+    L::set_footer(b);
+    L::word(L::following(b)) |= L::PREV_FREE;
+    index_.insert(b);
+  }
+
+  // no free block fits: grow the heap, starting with the free block
+  // right before the break if there is one
+  char *grow(size_t size) {
+    char *b = top_;
+    size_t have = 0;
+
+    if(L::word(top_) & L::PREV_FREE) {
+      b = L::preceding(top_);
+      have = L::size(b);
+    }
+    if((size_t)(limit_ - top_) < size - have + L::header)
+      return NULL;
+    if(have != 0)
+      index_.remove(b);
+    top_ = b + size;
+    L::word(b) = size | (L::word(b) & L::PREV_FREE);
+    L::word(top_) = 0;
+    return b;
+  }
+
+ public:
+  policy_heap(void *mem, size_t len) {
+    uintptr_t start = ((uintptr_t)mem + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+
+    base_ = top_ = reinterpret_cast<char *>(start);
+    limit_ = reinterpret_cast<char *>(mem) + len;
+    L::word(top_) = 0;
+  }
+
+  void *allocate(size_t n) {
+    size_t size = L::round(n + L::header);
+    char *b;
+
+    if(size < L::min_block)
+      size = L::min_block;
+    b = index_.find(size);
+    if(b != NULL) {
+      index_.remove(b);
+      place(b, size);
+    } else if((b = grow(size)) == NULL) {
+      return NULL;
+    }
+    return b + L::header;
+  }
+
+  void deallocate(void *p) {
+    if(p != NULL)
+      free_block(reinterpret_cast<char *>(p) - L::header);
+  }
+
+  // resize in place if the block is already large enough, copy otherwise
+  void *reallocate(void *p, size_t n) {
+    void *q;
+    size_t have;
+
+    if(p == NULL)
+      return allocate(n);
+    have = usable_size(p);
+    if(n <= have)
+      return p;
+    q = allocate(n);
+    if(q != NULL) {
+      __builtin_memcpy(q, p, have);
+      deallocate(p);
+    }
+    return q;
+  }
+
+  size_t usable_size(void *p) const {
+    return L::size(reinterpret_cast<char *>(p) - L::header) - L::header;
+  }
+
+  // bytes between the first block and the break, epilogue included
+  size_t heap_size() const {
+    return top_ + L::header - base_;
+  }
+};
+
+} // namespace dmm
+
+#endif /* end of __CPS310_DMM_POLICY_H__ */
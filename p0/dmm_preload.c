@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "dmm.h"
+
+/*
+ * LD_PRELOAD shim: the libc allocation functions on top of dmm.
+ *
+ * $> make libdmm.so
+ * $> LD_PRELOAD=./libdmm.so ls -l
+ *
+ * Bootstrap: dmm gets all of its memory from sbrk/mmap and initializes
+ * itself on the first dmalloc, so malloc works even before the dynamic
+ * loader is done and nothing needs dlsym to find the real allocator. The
+ * library is built with the initial-exec TLS model so the per-thread
+ * caches never go through __tls_get_addr, which can itself allocate.
+ *
+ * malloc, calloc and realloc return 16-byte aligned memory, as glibc does
+ * on x86-64 and as compiled code expects (SSE moves of malloc'd structs):
+ * the library is built with -DDMM_MALLOC_ALIGNMENT=16, which makes dmm
+ * align everything dmalloc returns to 16 bytes.
+ *
+ * -fno-builtin keeps gcc from treating the functions defined here as the
+ * libc ones, e.g. turning a malloc+memset into a call to calloc.
+ *
+ * Everything in dmm.c is hidden (-fvisibility=hidden); only the functions
+ * marked EXPORT below are seen by the program.
+ */
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* dmm.c is built with the same flags; without the alignment it is unsafe */
+#if !defined(DMM_MALLOC_ALIGNMENT) || DMM_MALLOC_ALIGNMENT < 16
+#error "build with -DDMM_MALLOC_ALIGNMENT=16 (make libdmm.so)"
+#endif
+
+/* larger requests would overflow dmm's size rounding */
+#define MAX_REQUEST (SIZE_MAX / 2)
+
+EXPORT void *malloc(size_t size) {
+  void *ptr;
+
+  if(size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ptr = dmalloc(size != 0 ? size : 1);
+  if(ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+EXPORT void free(void *ptr) {
+  dfree(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size) {
+  size_t total;
+  void *ptr;
+
+  if(__builtin_mul_overflow(nmemb, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if(total > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ptr = dcalloc(1, total != 0 ? total : 1);
+  if(ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+  return dmalloc_usable_size(ptr);
+}
+
+EXPORT void *realloc(void *ptr, size_t size) {
+  void *newptr;
+
+  if(ptr == NULL)
+    return malloc(size);
+  if(size > MAX_REQUEST) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  newptr = drealloc(ptr, size != 0 ? size : 1);
+  if(newptr == NULL)
+    errno = ENOMEM;
+  return newptr;
+}
+
+/* aligned: size bytes at a multiple of alignment (a power of two) */
+static void *aligned(size_t alignment, size_t size) {
+  void *ptr;
+
+  if(size > MAX_REQUEST - alignment) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ptr = dmemalign(alignment, size != 0 ? size : 1);
+  if(ptr == NULL)
+    errno = ENOMEM;
+  return ptr;
+}
+
+static inline int power_of_two(size_t x) {
+  return x != 0 && (x & (x - 1)) == 0;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+
+  if(!power_of_two(alignment) || alignment % sizeof(void *) != 0)
+    return EINVAL;
+  ptr = aligned(alignment, size);
+  if(ptr == NULL)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size) {
+  if(!power_of_two(alignment)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return aligned(alignment, size);
+}
+
+EXPORT void *memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+EXPORT void *valloc(size_t size) {
+  return aligned((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  return aligned(page, (size + page - 1) & ~(page - 1));
+}
+
+/* fork safety: install dmm's handlers as soon as the library is loaded */
+__attribute__((constructor)) static void preload_init() {
+  pthread_atfork(dmalloc_prefork, dmalloc_postfork_parent, dmalloc_postfork_child);
+}
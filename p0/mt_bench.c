@@ -0,0 +1,396 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/*
+ * Multi-threaded allocator benchmarks after larson, threadtest and
+ * xmalloc-test, plus a false-sharing check. Each workload runs at 1, 2,
+ * 4, ... up to max_threads threads and reports throughput and peak RSS.
+ * Every run is a child process of its own, so its peak RSS is not
+ * inherited from the run before. The allocator is picked at compile time:
+ *
+ * $> gcc -I. -Wall -O2 -DNDEBUG -pthread -o mt_bench mt_bench.c dmm.c
+ * $> gcc -I. -Wall -O2 -DBENCH_LIBC -pthread -o mt_bench_libc mt_bench.c
+ * $> ./mt_bench [workload] [max_threads]
+ *
+ *   threadtest     every thread allocates a batch of objects and frees it,
+ *                  over and over (per-thread churn, nothing shared)
+ *   larson         every thread replaces random objects in an array; each
+ *                  round the arrays pass to new threads, which free what
+ *                  the old ones allocated
+ *   xmalloc        producers allocate batches, consumers free them
+ *                  (every free is a cross-thread free)
+ *   false-sharing  every thread writes its own 8-byte object; counts the
+ *                  objects that share a cache line with another thread's,
+ *                  for objects allocated by each thread (active) and for
+ *                  objects allocated after freeing one handed over by the
+ *                  main thread (passive)
+ *
+ * Without a workload all four run; max_threads defaults to 8. Throughput
+ * is allocations plus frees per second (writes per second for
+ * false-sharing), wall time including thread creation.
+ */
+
+#if defined(BENCH_LIBC)
+#define ALLOCATOR "glibc"
+#define bench_malloc(n) malloc(n)
+#define bench_free(p) free(p)
+#else
+#include "dmm.h"
+#define ALLOCATOR "dmm"
+#define bench_malloc(n) dmalloc(n)
+#define bench_free(p) dfree(p)
+#endif
+
+#define MAX_THREADS (64)
+
+#define MIN_SIZE (16)
+#define MAX_SIZE (512)
+
+#define TT_ROUNDS (200)
+#define TT_BATCH (5000)
+#define TT_SIZE (64)
+
+#define LARSON_SLOTS (1000)
+#define LARSON_ROUNDS (10)
+#define LARSON_OPS (100000)
+
+#define XM_BATCH (256)
+#define XM_BATCHES (2000)
+#define XM_QUEUE (16)
+
+#define FS_SIZE (8)
+#define FS_WRITES (10000000)
+#define CACHE_LINE (64)
+
+typedef struct worker {
+	pthread_t tid;
+	int id;
+	unsigned short seed[3];
+	long ops;
+	void **slots;         /* larson: the array this thread works on */
+	volatile char *obj;   /* false-sharing: the object this thread writes */
+} worker_t;
+
+static worker_t workers[MAX_THREADS];
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *must_malloc(size_t size) {
+	void *p = bench_malloc(size);
+	if(p == NULL) {
+		fprintf(stderr, "allocation of %zu bytes failed\n", size);
+		exit(1);
+	}
+	return p;
+}
+
+static size_t random_size(worker_t *w) {
+	return MIN_SIZE + (size_t)(erand48(w->seed) * (MAX_SIZE - MIN_SIZE));
+}
+
+static void seed_workers(int nthreads) {
+	int i;
+
+	for(i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		workers[i].seed[0] = 0x330e;
+		workers[i].seed[1] = i;
+		workers[i].seed[2] = i >> 16;
+		workers[i].ops = 0;
+	}
+}
+
+static long run_workers(int nthreads, void *(*func)(void *)) {
+	long ops = 0;
+	int i;
+
+	for(i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].tid, NULL, func, &workers[i]);
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		ops += workers[i].ops;
+		workers[i].ops = 0;
+	}
+	return ops;
+}
+
+/* threadtest */
+
+static void *threadtest(void *arg) {
+	worker_t *w = arg;
+	char **objs = must_malloc(TT_BATCH * sizeof(char *));
+	int r, i;
+
+	for(r = 0; r < TT_ROUNDS; r++) {
+		for(i = 0; i < TT_BATCH; i++) {
+			objs[i] = must_malloc(TT_SIZE);
+			objs[i][0] = (char)i;
+		}
+		for(i = 0; i < TT_BATCH; i++)
+			bench_free(objs[i]);
+	}
+	bench_free(objs);
+	w->ops = 2L * TT_ROUNDS * TT_BATCH;
+	return NULL;
+}
+
+static long run_threadtest(int nthreads, char *extra) {
+	seed_workers(nthreads);
+	return run_workers(nthreads, threadtest);
+}
+
+/* larson */
+
+static void *larson(void *arg) {
+	worker_t *w = arg;
+	size_t size;
+	int i, k;
+
+	for(i = 0; i < LARSON_OPS; i++) {
+		k = (int)(erand48(w->seed) * LARSON_SLOTS);
+		bench_free(w->slots[k]);
+		size = random_size(w);
+		w->slots[k] = must_malloc(size);
+		memset(w->slots[k], k, size < 32 ? size : 32);
+	}
+	w->ops = 2L * LARSON_OPS;
+	return NULL;
+}
+
+static long run_larson(int nthreads, char *extra) {
+	long ops = 0;
+	int i, k, r;
+
+	/* the main thread fills the arrays, so even the first round frees
+	 * another thread's objects */
+	seed_workers(nthreads);
+	for(i = 0; i < nthreads; i++) {
+		workers[i].slots = must_malloc(LARSON_SLOTS * sizeof(void *));
+		for(k = 0; k < LARSON_SLOTS; k++)
+			workers[i].slots[k] = must_malloc(random_size(&workers[i]));
+	}
+	for(r = 0; r < LARSON_ROUNDS; r++)
+		ops += run_workers(nthreads, larson);
+	for(i = 0; i < nthreads; i++) {
+		for(k = 0; k < LARSON_SLOTS; k++)
+			bench_free(workers[i].slots[k]);
+		bench_free(workers[i].slots);
+	}
+	return ops;
+}
+
+/* xmalloc: a bounded queue of batches between producers and consumers */
+
+static void *xm_queue[XM_QUEUE][XM_BATCH];
+static int xm_head, xm_count, xm_left;
+static pthread_mutex_t xm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t xm_not_full = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t xm_not_empty = PTHREAD_COND_INITIALIZER;
+
+static void *producer(void *arg) {
+	worker_t *w = arg;
+	void *batch[XM_BATCH];
+	int b, i;
+
+	for(b = 0; b < XM_BATCHES; b++) {
+		for(i = 0; i < XM_BATCH; i++) {
+			batch[i] = must_malloc(random_size(w));
+			*(char *)batch[i] = (char)i;
+		}
+		pthread_mutex_lock(&xm_lock);
+		while(xm_count == XM_QUEUE)
+			pthread_cond_wait(&xm_not_full, &xm_lock);
+		memcpy(xm_queue[(xm_head + xm_count) % XM_QUEUE], batch, sizeof(batch));
+		xm_count++;
+		pthread_cond_signal(&xm_not_empty);
+		pthread_mutex_unlock(&xm_lock);
+	}
+	w->ops = (long)XM_BATCHES * XM_BATCH;
+	return NULL;
+}
+
+static void *consumer(void *arg) {
+	worker_t *w = arg;
+	void *batch[XM_BATCH];
+	int i;
+
+	for(;;) {
+		pthread_mutex_lock(&xm_lock);
+		while(xm_count == 0 && xm_left > 0)
+			pthread_cond_wait(&xm_not_empty, &xm_lock);
+		if(xm_left == 0) {
+			pthread_mutex_unlock(&xm_lock);
+			return NULL;
+		}
+		memcpy(batch, xm_queue[xm_head], sizeof(batch));
+		xm_head = (xm_head + 1) % XM_QUEUE;
+		xm_count--;
+		/* the last batch wakes the other consumers up to exit */
+		if(--xm_left == 0)
+			pthread_cond_broadcast(&xm_not_empty);
+		pthread_cond_signal(&xm_not_full);
+		pthread_mutex_unlock(&xm_lock);
+		for(i = 0; i < XM_BATCH; i++)
+			bench_free(batch[i]);
+		w->ops += XM_BATCH;
+	}
+}
+
+static long run_xmalloc(int nthreads, char *extra) {
+	int producers = nthreads / 2, i;
+	long ops = 0;
+
+	seed_workers(nthreads);
+	xm_head = xm_count = 0;
+	xm_left = producers * XM_BATCHES;
+	for(i = 0; i < nthreads; i++)
+		pthread_create(&workers[i].tid, NULL, i < producers ? producer : consumer, &workers[i]);
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		ops += workers[i].ops;
+	}
+	return ops;
+}
+
+/* false-sharing */
+
+static pthread_barrier_t fs_barrier;
+static int fs_passive;
+
+static void *false_sharing(void *arg) {
+	worker_t *w = arg;
+	int i;
+
+	if(fs_passive)
+		bench_free((void *)w->obj);
+	w->obj = must_malloc(FS_SIZE);
+	/* every object is live before anyone writes */
+	pthread_barrier_wait(&fs_barrier);
+	for(i = 0; i < FS_WRITES; i++)
+		w->obj[i % FS_SIZE]++;
+	pthread_barrier_wait(&fs_barrier);
+	w->ops = FS_WRITES;
+	return NULL;
+}
+
+/* objects on a cache line with another thread's object */
+static int shared_lines(int nthreads) {
+	int i, j, shared = 0;
+
+	for(i = 0; i < nthreads; i++)
+		for(j = 0; j < nthreads; j++)
+			if(i != j && (uintptr_t)workers[i].obj / CACHE_LINE == (uintptr_t)workers[j].obj / CACHE_LINE) {
+				shared++;
+				break;
+			}
+	return shared;
+}
+
+static long run_false_sharing(int nthreads, char *extra) {
+	int active, passive, i;
+	long ops;
+
+	seed_workers(nthreads);
+	pthread_barrier_init(&fs_barrier, NULL, nthreads);
+
+	/* passive first, while the main thread's objects really are back to
+	 * back: the threads free them and allocate their own */
+	for(i = 0; i < nthreads; i++)
+		workers[i].obj = must_malloc(FS_SIZE);
+	fs_passive = 1;
+	ops = run_workers(nthreads, false_sharing);
+	passive = shared_lines(nthreads);
+	for(i = 0; i < nthreads; i++)
+		bench_free((void *)workers[i].obj);
+
+	fs_passive = 0;
+	ops += run_workers(nthreads, false_sharing);
+	active = shared_lines(nthreads);
+	for(i = 0; i < nthreads; i++)
+		bench_free((void *)workers[i].obj);
+	pthread_barrier_destroy(&fs_barrier);
+
+	sprintf(extra, ", shared lines: active %d/%d, passive %d/%d", active, nthreads, passive, nthreads);
+	return ops;
+}
+
+typedef struct workload {
+	const char *name;
+	long (*run)(int nthreads, char *extra);
+	int min_threads;
+} workload_t;
+
+static const workload_t workloads[] = {
+	{ "threadtest", run_threadtest, 1 },
+	{ "larson", run_larson, 1 },
+	{ "xmalloc", run_xmalloc, 2 },
+	{ "false-sharing", run_false_sharing, 2 },
+};
+
+#define NWORKLOADS ((int)(sizeof(workloads) / sizeof(workloads[0])))
+
+/* one run in a child process of its own */
+static int run_child(const workload_t *w, int nthreads) {
+	struct rusage ru;
+	char extra[128] = "";
+	double begin, time_spent;
+	long ops;
+	pid_t pid;
+	int status;
+
+	fflush(stdout);
+	pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		return 1;
+	}
+	if(pid == 0) {
+		begin = now();
+		ops = w->run(nthreads, extra);
+		time_spent = now() - begin;
+		getrusage(RUSAGE_SELF, &ru);
+		printf("%-5s %-13s threads: %2d, wall time: %7.3f seconds, throughput: %10.0f ops/sec, peak RSS: %6.1f MB%s\n",
+			ALLOCATOR, w->name, nthreads, time_spent, ops / time_spent, ru.ru_maxrss / 1024.0, extra);
+		fflush(stdout);
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int main(int argc, char *argv[]) {
+	int max_threads = 8, fail = 0, found = 0, i, n;
+
+	if(argc > 2)
+		max_threads = atoi(argv[2]);
+	if(max_threads < 1 || max_threads > MAX_THREADS) {
+		fprintf(stderr, "usage: %s [threadtest|larson|xmalloc|false-sharing|all] [max_threads <= %d]\n",
+			argv[0], MAX_THREADS);
+		return 1;
+	}
+	for(i = 0; i < NWORKLOADS; i++) {
+		if(argc > 1 && strcmp(argv[1], "all") != 0 && strcmp(argv[1], workloads[i].name) != 0)
+			continue;
+		found = 1;
+		for(n = 1; n <= max_threads; n *= 2)
+			if(n >= workloads[i].min_threads)
+				fail |= run_child(&workloads[i], n);
+	}
+	if(!found) {
+		fprintf(stderr, "unknown workload %s\n", argv[1]);
+		return 1;
+	}
+	return fail;
+}
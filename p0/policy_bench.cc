@@ -0,0 +1,146 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "dmm_policy.h"
+
+/*
+ * Replays allocation traces (same format as trace_bench.c) against a set
+ * of policy_heap instantiations, one line per instantiation and trace:
+ * throughput, peak heap size and utilization (peak live requested bytes
+ * over peak heap), so the best policy for a workload can be picked.
+ *
+ * $> g++ -I. -Wall -O2 -o policy_bench policy_bench.cc
+ * $> ./policy_bench traces/binary-tree.trace traces/frag.trace ...
+ */
+
+#define ARENA_BYTES ((size_t)1 << 30)
+
+struct op_t {
+  char type;
+  int id;
+  size_t size;
+};
+
+static op_t *read_trace(const char *path, int *nops, int *nids) {
+  FILE *f = fopen(path, "r");
+  char line[256];
+  op_t *ops = NULL;
+  int n = 0, cap = 0, fields;
+
+  if(f == NULL) {
+    perror(path);
+    return NULL;
+  }
+  *nids = 0;
+  while(fgets(line, sizeof(line), f) != NULL) {
+    if(line[0] == '#' || line[0] == '\n')
+      continue;
+    if(n == cap) {
+      cap = cap ? cap * 2 : 4096;
+      ops = (op_t *)realloc(ops, cap * sizeof(op_t));
+    }
+    ops[n].size = 0;
+    fields = sscanf(line, "%c %d %zu", &ops[n].type, &ops[n].id, &ops[n].size);
+    if(fields < 2 || ops[n].id < 0 || (ops[n].type != 'f' && fields < 3)
+       || (ops[n].type != 'a' && ops[n].type != 'f' && ops[n].type != 'r')) {
+      fprintf(stderr, "%s: bad line: %s", path, line);
+      fclose(f);
+      free(ops);
+      return NULL;
+    }
+    if(ops[n].id >= *nids)
+      *nids = ops[n].id + 1;
+    n++;
+  }
+  fclose(f);
+  *nops = n;
+  return ops;
+}
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *arena;
+
+template <class Heap>
+static void replay(const char *name, const char *trace, const op_t *ops, int nops, int nids) {
+  Heap heap(arena, ARENA_BYTES);
+  void **blocks = (void **)calloc(nids, sizeof(void *));
+  size_t *sizes = (size_t *)calloc(nids, sizeof(size_t));
+  size_t live = 0, peak_live = 0;
+  uint64_t begin;
+  void *p;
+  int i, id;
+
+  // every instantiation starts on untouched pages
+  madvise(arena, ARENA_BYTES, MADV_DONTNEED);
+  begin = now_ns();
+  for(i = 0; i < nops; i++) {
+    id = ops[i].id;
+    if(ops[i].type == 'f') {
+      heap.deallocate(blocks[id]);
+      blocks[id] = NULL;
+      live -= sizes[id];
+      sizes[id] = 0;
+      continue;
+    }
+    if(ops[i].type == 'a')
+      p = heap.allocate(ops[i].size);
+    else
+      p = heap.reallocate(blocks[id], ops[i].size);
+    if(p == NULL) {
+      fprintf(stderr, "%s: op %d: allocation of %zu bytes failed\n", name, i, ops[i].size);
+      exit(1);
+    }
+    blocks[id] = p;
+    live += ops[i].size - sizes[id];
+    sizes[id] = ops[i].size;
+    if(live > peak_live)
+      peak_live = live;
+  }
+  // the heap never shrinks, its final size is its peak
+  printf("%-32s %-24s ops/sec: %10.0f  peak heap: %9zu  utilization: %5.1f%%\n",
+    name, trace, nops / ((now_ns() - begin) / 1e9), heap.heap_size(),
+    100.0 * peak_live / heap.heap_size());
+  free(blocks);
+  free(sizes);
+}
+
+int main(int argc, char *argv[]) {
+  op_t *ops;
+  int nops, nids, t;
+
+  if(argc < 2) {
+    fprintf(stderr, "usage: %s trace...\n", argv[0]);
+    return 1;
+  }
+  // untouched pages of the arena cost nothing
+  arena = (char *)mmap(NULL, ARENA_BYTES, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(arena == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  for(t = 1; t < argc; t++) {
+    ops = read_trace(argv[t], &nops, &nids);
+    if(ops == NULL)
+      return 1;
+    replay<dmm::policy_heap<dmm::first_fit> >("first_fit", argv[t], ops, nops, nids);
+    replay<dmm::policy_heap<dmm::next_fit> >("next_fit", argv[t], ops, nops, nids);
+    replay<dmm::policy_heap<dmm::best_fit> >("best_fit", argv[t], ops, nops, nids);
+    replay<dmm::policy_heap<dmm::segregated_fit> >("segregated_fit", argv[t], ops, nops, nids);
+    replay<dmm::policy_heap<dmm::first_fit, 32, 50> >("first_fit, split at 50%", argv[t], ops, nops, nids);
+    replay<dmm::policy_heap<dmm::best_fit, 32, 50> >("best_fit, split at 50%", argv[t], ops, nops, nids);
+    replay<dmm::policy_heap<dmm::segregated_fit, 32, 50> >("segregated_fit, split at 50%", argv[t], ops, nops, nids);
+    replay<dmm::policy_heap<dmm::segregated_fit, 256> >("segregated_fit, cut >= 256", argv[t], ops, nops, nids);
+    free(ops);
+  }
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include <sys/mman.h>
+#include "segment.h"
+
+// Address space reserved for the segment; pages are only touched when used
+#define MAX_SEGMENT_SIZE ((size_t)1 << 32)
+
+static char *segment_start = NULL;
+static size_t segment_size = 0;
+
+void *init_heap_segment(size_t npages) {
+  if(segment_start == NULL) {
+    segment_start = mmap(NULL, MAX_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(segment_start == MAP_FAILED) {
+      segment_start = NULL;
+      return NULL;
+    }
+  } else {
+    // give the old heap's pages back before starting over
+    madvise(segment_start, segment_size, MADV_DONTNEED);
+  }
+  segment_size = npages * PAGE_SIZE;
+  return segment_start;
+}
+
+void *extend_heap_segment(size_t npages) {
+  char *new_pages = segment_start + segment_size;
+
+  if(segment_size + npages * PAGE_SIZE > MAX_SEGMENT_SIZE)
+    return NULL;
+  segment_size += npages * PAGE_SIZE;
+  return new_pages;
+}
+
+void *heap_segment_start() {
+  return segment_start;
+}
+
+size_t heap_segment_size() {
+  return segment_size;
+}
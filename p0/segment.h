@@ -0,0 +1,26 @@
+/*
+ * segment.h -- page-granular heap segment for dmm1.c
+ *
+ * The heap is one contiguous range that starts at heap_segment_start()
+ * and only grows at its end, a page at a time.
+ */
+#ifndef _SEGMENT_H
+#define _SEGMENT_H
+
+#include <stddef.h>
+
+#define PAGE_SIZE 4096
+
+/* (re)initializes an empty heap of npages pages, returns its start */
+void *init_heap_segment(size_t npages);
+
+/* grows the heap by npages pages, returns the start of the new pages or
+ * NULL if the segment is full */
+void *extend_heap_segment(size_t npages);
+
+void *heap_segment_start();
+
+/* current size of the heap in bytes */
+size_t heap_segment_size();
+
+#endif
@@ -0,0 +1,121 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <list>
+#include <vector>
+#include <string>
+
+#include "dmm_allocator.h"
+
+/*
+ * Standard containers on dmm_allocator, dmm_pool_allocator and the pmr
+ * resources, then map node churn on the pool against std::allocator.
+ *
+ * $> gcc -I. -Wall -O2 -pthread -c dmm.c
+ * $> g++ -I. -Wall -O2 -o test_allocator test_allocator.cc dmm.o -pthread && ./test_allocator
+ */
+
+#define NKEYS 1000
+#define ROUNDS 2000
+
+struct alignas(64) line {
+  char bytes[64];
+};
+
+template <class Map>
+static double churn() {
+  Map m;
+  clock_t begin = clock();
+  int r, k;
+
+  for(r = 0; r < ROUNDS; r++) {
+    for(k = 0; k < NKEYS; k++)
+      m[k] = r;
+    for(k = 0; k < NKEYS; k++)
+      m.erase(k);
+  }
+  return (double)(clock() - begin) / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char *argv[]) {
+  dmalloc_stats_t s, t;
+  int i;
+
+  printf("dmm_allocator: vector and over-aligned types\n");
+  {
+    std::vector<int, dmm_allocator<int> > v;
+    for(i = 0; i < 100000; i++)
+      v.push_back(i);
+    for(i = 0; i < 100000; i++)
+      assert(v[i] == i);
+    std::vector<line, dmm_allocator<line> > lines(10);
+    assert((uintptr_t)&lines[0] % 64 == 0);
+  }
+
+  printf("dmm_pool_allocator: freed nodes are reused\n");
+  {
+    typedef std::map<int, int, std::less<int>, dmm_pool_allocator<std::pair<const int, int> > > pool_map;
+    pool_map m;
+
+    for(i = 0; i < NKEYS; i++)
+      m[i] = i;
+    for(i = 0; i < NKEYS; i++)
+      m.erase(i);
+    dmalloc_stats(&s);
+    for(i = 0; i < NKEYS; i++)
+      m[i] = -i;
+    for(i = 0; i < NKEYS; i++)
+      assert(m[i] == -i);
+    dmalloc_stats(&t);
+    assert(t.in_use == s.in_use && "a warm pool needs no dmalloc");
+
+    std::list<std::string, dmm_pool_allocator<std::string> > l;
+    for(i = 0; i < 100; i++)
+      l.push_back(std::string(i, 'x'));
+    i = 0;
+    for(std::list<std::string, dmm_pool_allocator<std::string> >::iterator it = l.begin(); it != l.end(); ++it, i++)
+      assert(it->size() == (size_t)i);
+  }
+
+#if __cplusplus >= 201703L && __has_include(<memory_resource>)
+  printf("dmm_memory_resource and dmm_region_resource back pmr containers\n");
+  {
+    std::pmr::vector<int> v(dmm_resource());
+    for(i = 0; i < 100000; i++)
+      v.push_back(i);
+    assert(v[99999] == 99999);
+    assert(*dmm_resource() == dmm_memory_resource());
+
+    std::pmr::unsynchronized_pool_resource pool(dmm_resource());
+    std::pmr::map<int, std::pmr::string> m(&pool);
+    for(i = 0; i < 1000; i++)
+      m[i] = std::pmr::string(i % 50, 'y');
+    assert(m[999].size() == 999 % 50);
+
+    dmm_region_resource region;
+    void *p = region.allocate(10, 256);
+    assert((uintptr_t)p % 256 == 0);
+    std::pmr::list<int> l(&region);
+    for(i = 0; i < 1000; i++)
+      l.push_back(i);
+    assert(l.back() == 999);
+    l.clear();
+    dmalloc_stats(&s);
+    region.release();
+    dmalloc_stats(&t);
+    assert(t.in_use < s.in_use && "release gives the region's blocks back");
+    assert(!(region == *dmm_resource()));
+  }
+#endif
+
+  printf("%d rounds of %d map inserts and erases\n", ROUNDS, NKEYS);
+  double t_std = churn<std::map<int, int> >();
+  double t_pool = churn<std::map<int, int, std::less<int>, dmm_pool_allocator<std::pair<const int, int> > > >();
+  printf("std::allocator: %g seconds, dmm_pool_allocator: %g seconds\n", t_std, t_pool);
+
+  printf("Allocator testcases passed!\n");
+  return 0;
+}
@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "dmm.h"
+
+#define NBLOCKS 16000
+
+static char *blocks[NBLOCKS];
+
+int main(int argc, char *argv[]) {
+	dmalloc_stats_t s;
+	char *brk0, *wall, *array1;
+	long page = sysconf(_SC_PAGESIZE);
+	int i, initial;
+
+	printf("dmalloc_init_heap(1MB) sets the initial size\n");
+	brk0 = sbrk(0);
+	initial = dmalloc_init_heap(1024 * 1024);
+	assert(initial);
+	assert((char *)sbrk(0) - brk0 >= 1024 * 1024);
+	initial = dmalloc_init_heap(1024 * 1024);
+	assert(!initial && "the heap exists already");
+
+	printf("16MB of 1000-byte blocks grow the heap geometrically\n");
+	for(i = 0; i < NBLOCKS; i++) {
+		blocks[i] = (char*)dmalloc(1000);
+		if(blocks[i] == NULL)
+		{
+			fprintf(stderr,"call to dmalloc() failed\n");
+			fflush(stderr);
+			exit(1);
+		}
+		memset(blocks[i], i, 1000);
+	}
+	dmalloc_stats(&s);
+	assert(s.sbrk_grows < 20);
+
+	printf("a mapping right behind the break: the heap continues in mmap'd segments\n");
+	wall = (char *)(((uintptr_t)sbrk(0) + page - 1) & ~(uintptr_t)(page - 1));
+	wall = mmap(wall, page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	assert(wall != MAP_FAILED);
+	for(i = 0; i < NBLOCKS; i++)
+		dfree(blocks[i]);
+	for(i = 0; i < NBLOCKS; i++) {
+		blocks[i] = (char*)dmalloc(2000);
+		assert(blocks[i] != NULL);
+		memset(blocks[i], i, 2000);
+	}
+	dmalloc_stats(&s);
+	assert(s.region_maps >= 1);
+
+	printf("freeing everything leaves one free chunk per segment\n");
+	for(i = 0; i < NBLOCKS; i++) {
+		assert(blocks[i][1999] == (char)i);
+		dfree(blocks[i]);
+	}
+	dmalloc_stats(&s);
+	assert(s.free_blocks >= 2 && "segments never merge");
+	array1 = (char*)dmalloc(1000);
+	assert(array1 != NULL);
+	dfree(array1);
+
+	printf("Grow testcases passed!\n");
+	(void)brk0; (void)initial;
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "dmm.h"
+
+/*
+ * Handle objects interleaved with freed ones fragment the heap. Stepwise
+ * compaction gathers the holes into one free chunk that a large request
+ * fits into without growing the heap. Pinned objects stay where they are,
+ * every object keeps its contents.
+ */
+
+#define NOBJS 20000
+#define NPINNED 4
+#define STEP (64*1024)
+
+static dhandle_t handles[NOBJS];
+
+static size_t obj_size(int i) {
+	return 24 + (i * 37) % 200;
+}
+
+static void fill(int i) {
+	memset(dhandle_pin(handles[i]), i & 0xff, obj_size(i));
+	dhandle_unpin(handles[i]);
+}
+
+static void check(int i) {
+	unsigned char *p = dhandle_pin(handles[i]);
+	size_t j;
+
+	for(j = 0; j < obj_size(i); j++)
+		assert(p[j] == (i & 0xff));
+	(void)p;
+	dhandle_unpin(handles[i]);
+}
+
+int main(int argc, char *argv[]) {
+	dmalloc_stats_t before, after;
+	void *pinned[NPINNED], *big;
+	size_t moved, freed = 0;
+	clock_t begin;
+	double t_compact;
+	int i, steps = 0;
+
+	// keep every object on the heap and the gathered space in it
+	dmalloc_set_mmap_threshold(64*1024*1024);
+	dmalloc_set_trim_threshold(64*1024*1024);
+
+	printf("odd handle objects freed between even ones fragment the heap\n");
+	for(i = 0; i < NOBJS; i++) {
+		handles[i] = dmalloc_handle(obj_size(i));
+		if(handles[i] == NULL)
+		{
+			fprintf(stderr,"call to dmalloc_handle() failed\n");
+			fflush(stderr);
+			exit(1);
+		}
+		fill(i);
+	}
+	for(i = 1; i < NOBJS; i += 2) {
+		dhandle_free(handles[i]);
+		handles[i] = NULL;
+		freed += obj_size(i);
+	}
+	for(i = 0; i < NPINNED; i++)
+		pinned[i] = dhandle_pin(handles[2 * i]);
+	dmalloc_stats(&before);
+
+	printf("compaction steps move the unpinned objects down\n");
+	begin = clock();
+	while((moved = dmalloc_compact(STEP)) != 0)
+		steps++;
+	t_compact = (double)(clock() - begin) / CLOCKS_PER_SEC;
+	dmalloc_stats(&after);
+	assert(steps > 1 && "compaction is incremental");
+	assert(after.compacted > before.compacted);
+	assert(after.largest_free >= before.largest_free + freed);
+	assert(after.in_use == before.in_use);
+
+	printf("pinned objects stay, all objects keep their contents\n");
+	for(i = 0; i < NPINNED; i++) {
+		assert(dhandle_pin(handles[2 * i]) == pinned[i]);
+		dhandle_unpin(handles[2 * i]);
+		dhandle_unpin(handles[2 * i]);
+	}
+	for(i = 0; i < NOBJS; i += 2)
+		check(i);
+
+	printf("the gathered space takes a large object without growing the heap\n");
+	big = dmalloc(freed);
+	assert(big != NULL);
+	dmalloc_stats(&before);
+	assert(before.heap_size == after.heap_size);
+	memset(big, 1, freed);
+	dfree(big);
+
+	for(i = 0; i < NOBJS; i += 2)
+		dhandle_free(handles[i]);
+
+	printf("%d steps moved %zu bytes in %g seconds\n", steps, after.compacted, t_compact);
+
+	printf("Handle testcases passed!\n");
+	(void)pinned;
+	exit(0);
+}
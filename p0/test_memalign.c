@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "dmm.h"
+
+#define ALIGNED(p, a) ((uintptr_t)(p) % (a) == 0)
+
+int main(int argc, char *argv[]) {
+	dmalloc_stats_t start, before, s;
+	char *array1, *array2, *array3, *big;
+	size_t align;
+	int i;
+
+	printf("dmemalign(64, n) and dmemalign(4096, n) for small and medium n\n");
+	for(align = 16; align <= 4096; align *= 2) {
+		for(i = 1; i < 3000; i += 997) {
+			array1 = (char*)dmemalign(align, i);
+			if(array1 == NULL)
+			{
+				fprintf(stderr,"call to dmemalign() failed\n");
+				fflush(stderr);
+				exit(1);
+			}
+			assert(ALIGNED(array1, align));
+			assert(dmalloc_usable_size(array1) >= (size_t)i);
+			memset(array1, 'a', i);
+			dfree(array1);
+		}
+	}
+	array1 = (char*)dmemalign(16, 0);
+	assert(array1 != NULL && ALIGNED(array1, 16) && "size 0 is a minimal slot");
+	dfree(array1);
+	array1 = (char*)dmemalign(3000, 100);
+	assert(array1 == NULL && "alignment must be a power of two");
+
+	printf("the leading fragment is a free chunk and coalesces back\n");
+	/* small chunks freed above stay in this thread's cache */
+	dmalloc_stats(&start);
+	array1 = (char*)dmalloc(1000);
+	dmalloc_stats(&before);
+	array2 = (char*)dmemalign(4096, 1000);
+	assert(ALIGNED(array2, 4096));
+	array3 = (char*)dmalloc(1000);
+	dmalloc_stats(&s);
+	assert(s.in_use == before.in_use + dmalloc_usable_size(array2) + dmalloc_usable_size(array3));
+	assert(s.in_use - before.in_use < 2 * 1000 + 64 && "no alignment padding stays allocated");
+	dfree(array2);
+	dfree(array1);
+	dfree(array3);
+	dmalloc_stats(&s);
+	assert(s.in_use == start.in_use);
+	assert(s.free_blocks == start.free_blocks && "everything merged back together");
+
+	printf("dmemalign(4096, 1MB) and dmemalign(1MB, 200000) are mmap'd\n");
+	big = (char*)dmemalign(4096, 1024 * 1024);
+	assert(big != NULL && ALIGNED(big, 4096));
+	memset(big, 'b', 1024 * 1024);
+	array1 = (char*)dmemalign(1024 * 1024, 200000);
+	assert(array1 != NULL && ALIGNED(array1, 1024 * 1024));
+	memset(array1, 'c', 200000);
+	array1 = (char*)drealloc(array1, 300000);
+	assert(array1 != NULL && array1[199999] == 'c');
+	dfree(big);
+	dfree(array1);
+	dmalloc_stats(&s);
+	assert(s.in_use == start.in_use);
+
+	printf("Memalign testcases passed!\n");
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+
+#include "dmm.h"
+
+/* resident set size in pages, or -1 where /proc is not available */
+static long rss_pages() {
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if(f == NULL)
+		return -1;
+	if(fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(f);
+	return resident;
+}
+
+int main(int argc, char *argv[]) {
+	char *big, *small;
+	long before, during, after;
+	size_t i, size = 8*1024*1024;
+
+	before = rss_pages();
+
+	printf("malloc(%zu)\n", size);
+	big = (char*)dmalloc(size);
+	if(big == NULL)
+	{
+		fprintf(stderr,"call to dmalloc() failed\n");
+		fflush(stderr);
+		exit(1);
+	}
+	memset(big, 'a', size);
+	during = rss_pages();
+
+	printf("free(%zu)\n", size);
+	dfree(big);
+	after = rss_pages();
+	printf("RSS pages before: %ld, while allocated: %ld, after free: %ld\n", before, during, after);
+	if(before >= 0)
+		assert(after < during && "large block was not given back to the OS");
+
+	printf("realloc growth of a large block\n");
+	big = (char*)dmalloc(256*1024);
+	assert(big != NULL);
+	memset(big, 'b', 256*1024);
+	for(i = 1; i <= 8; i++) {
+		big = (char*)drealloc(big, 256*1024*(i+1));
+		assert(big != NULL);
+		assert(big[0] == 'b' && big[256*1024-1] == 'b');
+	}
+	dfree(big);
+
+	printf("realloc from the heap into the mmap path and back\n");
+	small = (char*)dmalloc(100);
+	assert(small != NULL);
+	memset(small, 'c', 100);
+	small = (char*)drealloc(small, 1024*1024);
+	assert(small != NULL && small[99] == 'c');
+	small = (char*)drealloc(small, 50);
+	assert(small != NULL && small[49] == 'c');
+	dfree(small);
+
+	printf("Mmap testcases passed!\n");
+	return(0);
+}
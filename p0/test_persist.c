@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "dmm.h"
+
+/*
+ * A persistent heap survives close and reopen, a process that dies
+ * without closing it and a move to another address; damaged files are
+ * refused.
+ */
+
+#define MAX_SIZE (256*1024*1024)
+#define NNODES 100000
+
+/* a list node that lives in the file: links are offsets */
+typedef struct node {
+	size_t next;
+	int value;
+	char pad[20];
+} node_t;
+
+static char path[64], junk[64];
+
+static size_t file_size() {
+	struct stat st;
+
+	if(stat(path, &st) != 0)
+		return 0;
+	return st.st_size;
+}
+
+/* a list of NNODES nodes, with a freed object between any two */
+static node_t *build(dmm_persist_t *heap) {
+	node_t *head = NULL, *n;
+	void *gap;
+	int i;
+
+	for(i = 0; i < NNODES; i++) {
+		n = dmm_persist_alloc(heap, sizeof(node_t));
+		if(n == NULL)
+		{
+			fprintf(stderr,"call to dmm_persist_alloc() failed\n");
+			fflush(stderr);
+			exit(1);
+		}
+		gap = dmm_persist_alloc(heap, 8 + i % 100);
+		n->value = i;
+		n->next = dmm_persist_offset(heap, head);
+		head = n;
+		dmm_persist_free(heap, gap);
+	}
+	return head;
+}
+
+/* the list under the root, NNODES - 1 down to 0 plus delta */
+static void verify(dmm_persist_t *heap, int delta) {
+	node_t *n = dmm_persist_root(heap);
+	int i;
+
+	for(i = NNODES - 1; i >= 0; i--) {
+		assert(n != NULL && n->value == i + delta);
+		n = dmm_persist_ptr(heap, n->next);
+	}
+	assert(n == NULL);
+}
+
+int main(int argc, char *argv[]) {
+	dmm_persist_t *heap, *other;
+	node_t *n;
+	clock_t begin;
+	double t_build, t_open;
+	size_t size, off;
+	pid_t pid;
+	int status, fd;
+	void *big;
+	bool synced;
+
+	snprintf(path, sizeof(path), "/tmp/test_persist.%d", (int)getpid());
+	snprintf(junk, sizeof(junk), "/tmp/test_persist_junk.%d", (int)getpid());
+	unlink(path);
+
+	printf("a new heap keeps its root and objects across close and open\n");
+	heap = dmm_persist_open(path, MAX_SIZE);
+	assert(heap != NULL && dmm_persist_root(heap) == NULL);
+	begin = clock();
+	dmm_persist_set_root(heap, build(heap));
+	t_build = (double)(clock() - begin) / CLOCKS_PER_SEC;
+	synced = dmm_persist_sync(heap);
+	assert(synced);
+	dmm_persist_close(heap);
+	begin = clock();
+	heap = dmm_persist_open(path, MAX_SIZE);
+	t_open = (double)(clock() - begin) / CLOCKS_PER_SEC;
+	assert(heap != NULL);
+	verify(heap, 0);
+
+	printf("another process cannot open the heap while it is open\n");
+	pid = fork();
+	if(pid == 0) {
+		fd = open(path, O_RDWR);
+		_exit(fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0 ? 0 : 1);
+	}
+	waitpid(pid, &status, 0);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	printf("a process that dies without closing loses nothing\n");
+	dmm_persist_close(heap);
+	pid = fork();
+	if(pid == 0) {
+		heap = dmm_persist_open(path, MAX_SIZE);
+		for(n = dmm_persist_root(heap); n != NULL; n = dmm_persist_ptr(heap, n->next))
+			n->value += 1000;
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+	assert(WIFEXITED(status));
+	heap = dmm_persist_open(path, MAX_SIZE);
+	assert(heap != NULL);
+	verify(heap, 1000);
+
+	printf("freed space coalesces and is reused before the file grows\n");
+	size = file_size();
+	while((n = dmm_persist_root(heap)) != NULL) {
+		dmm_persist_set_root(heap, dmm_persist_ptr(heap, n->next));
+		dmm_persist_free(heap, n);
+	}
+	big = dmm_persist_alloc(heap, size / 2);
+	assert(big != NULL && file_size() == size);
+	dmm_persist_free(heap, big);
+	dmm_persist_set_root(heap, build(heap));
+	assert(file_size() == size);
+	n = dmm_persist_root(heap);
+	dmm_persist_close(heap);
+
+	printf("the heap is valid wherever the file is mapped\n");
+	big = mmap(NULL, MAX_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	heap = dmm_persist_open(path, MAX_SIZE);
+	assert(heap != NULL);
+	verify(heap, 0);
+	assert(dmm_persist_root(heap) != n && "the old address range is taken");
+	off = dmm_persist_offset(heap, dmm_persist_root(heap));
+	dmm_persist_close(heap);
+	munmap(big, MAX_SIZE);
+
+	printf("damaged files and other files are refused\n");
+	fd = open(path, O_RDWR);
+	if(fd < 0 || pwrite(fd, "\xff\xff\xff\xff", 4, off - HEADER_SIZE) != 4) {
+		fprintf(stderr,"cannot damage %s\n", path);
+		exit(1);
+	}
+	close(fd);
+	other = dmm_persist_open(path, MAX_SIZE);
+	assert(other == NULL);
+	fd = open(junk, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || write(fd, "not a heap", 10) != 10) {
+		fprintf(stderr,"cannot write %s\n", junk);
+		exit(1);
+	}
+	close(fd);
+	other = dmm_persist_open(junk, MAX_SIZE);
+	assert(other == NULL);
+	other = dmm_persist_open(path, 4096);
+	assert(other == NULL && "the file is larger than max_size");
+	unlink(junk);
+	unlink(path);
+	(void)synced; (void)other; /* only read by the asserts */
+
+	printf("building %d nodes: %g seconds, reopening and checking them: %g seconds\n", NNODES, t_build, t_open);
+
+	printf("Persist testcases passed!\n");
+	exit(0);
+}
@@ -0,0 +1,131 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <stdint.h>
+
+#include "dmm_policy.h"
+
+/*
+ * policy_heap instantiations: every placement policy runs the same random
+ * workload, then the policy-specific choices are checked one by one.
+ *
+ * $> g++ -I. -Wall -O2 -o test_policy test_policy.cc && ./test_policy
+ */
+
+#define HEAP_BYTES (16*1024*1024)
+#define NSLOTS 1000
+#define LOOPCNT 100000
+
+static char buffer[HEAP_BYTES];
+
+template <class Heap>
+static void random_workload(const char *name, size_t alignment) {
+  Heap heap(buffer, sizeof(buffer));
+  char *ptr[NSLOTS] = { NULL };
+  size_t size[NSLOTS];
+  int i, j, k;
+
+  printf("%s: random allocations and frees keep their data\n", name);
+  srandom(310);
+  for(i = 0; i < LOOPCNT; i++) {
+    k = random() % NSLOTS;
+    if(ptr[k] == NULL) {
+      size[k] = 1 + random() % (random() % 8 == 0 ? 20000 : 200);
+      ptr[k] = (char *)heap.allocate(size[k]);
+      assert(ptr[k] != NULL);
+      assert((uintptr_t)ptr[k] % alignment == 0);
+      assert(heap.usable_size(ptr[k]) >= size[k]);
+      memset(ptr[k], k, size[k]);
+    } else {
+      for(j = 0; j < (int)size[k]; j += 61)
+        assert(ptr[k][j] == (char)k);
+      heap.deallocate(ptr[k]);
+      ptr[k] = NULL;
+    }
+  }
+  for(k = 0; k < NSLOTS; k++)
+    heap.deallocate(ptr[k]);
+
+  // everything coalesced back into one block below the break
+  size_t all = heap.heap_size();
+  void *p = heap.allocate(all - 2 * alignment);
+  assert(p != NULL && heap.heap_size() == all);
+}
+
+int main(int argc, char *argv[]) {
+  random_workload<dmm::policy_heap<dmm::first_fit> >("first fit", 8);
+  random_workload<dmm::policy_heap<dmm::next_fit> >("next fit", 8);
+  random_workload<dmm::policy_heap<dmm::best_fit> >("best fit", 8);
+  random_workload<dmm::policy_heap<dmm::segregated_fit> >("segregated fit", 8);
+  random_workload<dmm::policy_heap<dmm::segregated_fit, 32, 50> >("segregated fit, split at 50%", 8);
+  random_workload<dmm::policy_heap<dmm::first_fit, 32, 100, 64> >("first fit, 64-byte alignment", 64);
+
+  printf("best fit takes the smaller hole, first fit the first one\n");
+  {
+    dmm::policy_heap<dmm::first_fit> ff(buffer, sizeof(buffer));
+    char *small = (char *)ff.allocate(100), *a = (char *)ff.allocate(8);
+    char *large = (char *)ff.allocate(200), *b = (char *)ff.allocate(8);
+    ff.deallocate(small);
+    ff.deallocate(large);
+    assert(ff.allocate(90) == large);
+    (void)a; (void)b;
+  }
+  {
+    dmm::policy_heap<dmm::best_fit> bf(buffer, sizeof(buffer));
+    char *small = (char *)bf.allocate(100), *a = (char *)bf.allocate(8);
+    char *large = (char *)bf.allocate(200), *b = (char *)bf.allocate(8);
+    bf.deallocate(small);
+    bf.deallocate(large);
+    assert(bf.allocate(90) == small);
+    (void)a; (void)b;
+  }
+
+  printf("next fit resumes where the last search stopped\n");
+  {
+    dmm::policy_heap<dmm::next_fit> nf(buffer, sizeof(buffer));
+    char *hole[3], *sep[3];
+    int i;
+
+    for(i = 0; i < 3; i++) {
+      hole[i] = (char *)nf.allocate(100);
+      sep[i] = (char *)nf.allocate(8);
+    }
+    for(i = 0; i < 3; i++)
+      nf.deallocate(hole[i]);
+    // the list is LIFO: hole 2, 1, 0
+    assert(nf.allocate(40) == hole[2]);
+    // first fit would take the rest of hole 2, now at the head of the list
+    assert(nf.allocate(40) == hole[1]);
+    assert(nf.allocate(100) == hole[0]);
+    (void)sep;
+  }
+
+  printf("AcceptablePercent keeps nearly full blocks whole\n");
+  {
+    dmm::policy_heap<dmm::first_fit, 32, 50> half(buffer, sizeof(buffer));
+    char *p = (char *)half.allocate(1000), *sep = (char *)half.allocate(8);
+    half.deallocate(p);
+    assert(half.allocate(600) == p && half.usable_size(p) >= 1000);
+    (void)sep;
+  }
+  {
+    dmm::policy_heap<dmm::first_fit, 32, 100> always(buffer, sizeof(buffer));
+    char *p = (char *)always.allocate(1000), *sep = (char *)always.allocate(8);
+    always.deallocate(p);
+    assert(always.allocate(600) == p && always.usable_size(p) < 1000);
+    (void)sep;
+  }
+
+  printf("SmallestCuttable keeps small remainders attached\n");
+  {
+    dmm::policy_heap<dmm::first_fit, 512> coarse(buffer, sizeof(buffer));
+    char *p = (char *)coarse.allocate(1000), *sep = (char *)coarse.allocate(8);
+    coarse.deallocate(p);
+    assert(coarse.allocate(600) == p && coarse.usable_size(p) >= 1000);
+    (void)sep;
+  }
+
+  printf("Policy testcases passed!\n");
+  return 0;
+}
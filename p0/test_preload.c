@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <malloc.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* malloc, calloc and realloc results must be 16-byte aligned, as glibc's are */
+#define ALIGNED16(p) (((uintptr_t)(p) & 15) == 0)
+
+/*
+ * Checks the libc allocation functions the way a program sees them. Run it
+ * with the shim preloaded (make preload-test):
+ *
+ * $> LD_PRELOAD=./libdmm.so ./test_preload
+ */
+int main(int argc, char *argv[]) {
+	Dl_info info;
+	char *array1, *array2;
+	void *aligned, *ptrs[64];
+	volatile size_t overflow = (size_t)-1 / 8;
+	size_t align;
+	pid_t pid;
+	int i, status;
+
+	if(dladdr((void *)malloc, &info) != 0 && info.dli_fname != NULL)
+		printf("malloc comes from %s\n", info.dli_fname);
+
+	printf("malloc(0), malloc(100), free\n");
+	array1 = malloc(0);
+	assert(array1 != NULL);
+	free(array1);
+	array1 = malloc(100);
+	assert(array1 != NULL && malloc_usable_size(array1) >= 100);
+	memset(array1, 'a', 100);
+	free(NULL);
+
+	printf("calloc zeroes recycled memory\n");
+	free(array1);
+	array1 = calloc(25, 4);
+	for(i = 0; i < 100; i++)
+		assert(array1[i] == 0);
+	array2 = calloc(overflow, 16);
+	assert(array2 == NULL);
+	array2 = calloc(0, 16);
+	assert(array2 != NULL);
+	free(array2);
+
+	printf("realloc keeps the contents\n");
+	memset(array1, 'b', 100);
+	array1 = realloc(array1, 5000);
+	assert(array1 != NULL);
+	for(i = 0; i < 100; i++)
+		assert(array1[i] == 'b');
+
+	printf("malloc, calloc and realloc results are 16-byte aligned\n");
+	for(i = 0; i < 64; i++) {
+		ptrs[i] = malloc(1 + i * 37 % 600);
+		assert(ptrs[i] != NULL && ALIGNED16(ptrs[i]));
+	}
+	for(i = 0; i < 64; i += 2) {
+		free(ptrs[i]);
+		ptrs[i] = calloc(1 + i % 7, 3 + i * 29 % 300);
+		assert(ptrs[i] != NULL && ALIGNED16(ptrs[i]));
+	}
+	for(i = 0; i < 64; i++) {
+		ptrs[i] = realloc(ptrs[i], 1 + i * 53 % 2000);
+		assert(ptrs[i] != NULL && ALIGNED16(ptrs[i]));
+	}
+	for(i = 0; i < 64; i++)
+		free(ptrs[i]);
+	array2 = malloc(1 << 20);
+	assert(array2 != NULL && ALIGNED16(array2));
+	array2 = realloc(array2, 3 << 20);
+	assert(array2 != NULL && ALIGNED16(array2));
+	free(array2);
+	assert(ALIGNED16(array1));
+
+	printf("posix_memalign, aligned_alloc, memalign\n");
+	for(align = 16; align <= 8192; align *= 2) {
+		status = posix_memalign(&aligned, align, 300);
+		assert(status == 0 && (uintptr_t)aligned % align == 0);
+		assert(malloc_usable_size(aligned) >= 300);
+		memset(aligned, 'c', 300);
+		aligned = realloc(aligned, 600);
+		assert(aligned != NULL && ((char *)aligned)[299] == 'c');
+		free(aligned);
+		aligned = aligned_alloc(align, 2 * align);
+		assert(aligned != NULL && (uintptr_t)aligned % align == 0);
+		free(aligned);
+		aligned = memalign(align, 10);
+		assert(aligned != NULL && (uintptr_t)aligned % align == 0);
+		free(aligned);
+	}
+	status = posix_memalign(&aligned, 24, 10);
+	assert(status != 0);
+
+	printf("fork, then allocate in both processes\n");
+	array2 = malloc(1000);
+	pid = fork();
+	assert(pid >= 0);
+	free(array2);
+	array2 = malloc(2000);
+	assert(array2 != NULL);
+	memset(array2, 'd', 2000);
+	free(array2);
+	free(array1);
+	if(pid == 0)
+		exit(0);
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "child failed\n");
+		exit(1);
+	}
+
+	printf("Preload testcases passed!\n");
+	return 0;
+}
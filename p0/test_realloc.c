@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+
+#include "dmm.h"
+
+/* all sizes are above the per-thread cache limit so freed neighbours go
+ * straight back to the heap */
+int main(int argc, char *argv[]) {
+	char *array1, *array2, *array3, *moved;
+	int i;
+
+	printf("malloc(1000), malloc(1000), malloc(1000)\n");
+	array1 = (char*)dmalloc(1000);
+	array2 = (char*)dmalloc(1000);
+	array3 = (char*)dmalloc(1000);
+	if(array1 == NULL || array2 == NULL || array3 == NULL)
+	{
+		fprintf(stderr,"call to dmalloc() failed\n");
+		fflush(stderr);
+		exit(1);
+	}
+	assert(dmalloc_usable_size(array1) >= 1000);
+	for(i=0; i < 1000; i++)
+	{
+		array1[i] = 'a';
+	}
+
+	printf("free(array2), realloc(array1, 1800) grows into it\n");
+	dfree(array2);
+	moved = (char*)drealloc(array1, 1800);
+	assert(moved == array1 && "growth into a free neighbour should not move");
+	assert(dmalloc_usable_size(array1) >= 1800);
+	for(i=0; i < 1000; i++)
+	{
+		assert(array1[i] == 'a');
+	}
+
+	printf("realloc(array1, 500) shrinks in place\n");
+	moved = (char*)drealloc(array1, 500);
+	assert(moved == array1);
+	assert(dmalloc_usable_size(array1) >= 500 && dmalloc_usable_size(array1) < 1800);
+
+	printf("malloc(1200) reuses the split-off tail\n");
+	array2 = (char*)dmalloc(1200);
+	assert(array2 > array1 && array2 < array3);
+
+	printf("realloc(array1, 5000) has to move\n");
+	moved = (char*)drealloc(array1, 5000);
+	assert(moved != NULL && moved != array1);
+	for(i=0; i < 500; i++)
+	{
+		assert(moved[i] == 'a');
+	}
+	memset(moved, 'b', 5000);
+
+	printf("realloc of the last chunk grows the heap behind it\n");
+	array1 = moved;
+	moved = (char*)drealloc(array1, 20000);
+	assert(moved != NULL);
+	for(i=0; i < 5000; i++)
+	{
+		assert(moved[i] == 'b');
+	}
+
+	dfree(moved);
+	dfree(array2);
+	dfree(array3);
+
+	printf("realloc(NULL, 0) is malloc(0), realloc(p, 0) frees p\n");
+	array1 = (char*)drealloc(NULL, 0);
+	assert(array1 != NULL);
+	array1 = (char*)drealloc(array1, 0);
+	assert(array1 == NULL);
+
+	printf("Realloc testcases passed!\n");
+	return(0);
+}
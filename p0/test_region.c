@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "dmm.h"
+
+#define NOBJS 10000
+#define REQUESTS 200
+
+static char *objs[NOBJS];
+
+static size_t obj_size(int i) {
+	return 8 + (i * 37) % 120;
+}
+
+/* one request's worth of objects, in the region or with dmalloc/dfree */
+static void request(dmm_region_t *region) {
+	int i;
+
+	for(i = 0; i < NOBJS; i++) {
+		objs[i] = region != NULL ? dmm_region_alloc(region, obj_size(i)) : dmalloc(obj_size(i));
+		if(objs[i] == NULL)
+		{
+			fprintf(stderr,"allocation failed\n");
+			fflush(stderr);
+			exit(1);
+		}
+		objs[i][0] = (char)i;
+	}
+	if(region != NULL) {
+		dmm_region_reset(region);
+	} else {
+		for(i = 0; i < NOBJS; i++)
+			dfree(objs[i]);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	dmalloc_stats_t start, s, r;
+	dmm_region_mark_t outer, inner;
+	dmm_region_t *region;
+	char *a, *b, *c;
+	clock_t begin;
+	double t_region, t_dmalloc;
+	int i;
+
+	/* the region structs are small objects, warm up their magazine */
+	dmm_region_destroy(dmm_region_create(0));
+	dmalloc_stats(&start);
+
+	printf("allocations are aligned, disjoint and keep their data\n");
+	region = dmm_region_create(0);
+	for(i = 0; i < NOBJS; i++) {
+		objs[i] = dmm_region_alloc(region, obj_size(i));
+		assert((uintptr_t)objs[i] % ALIGNMENT == 0);
+		memset(objs[i], i, obj_size(i));
+	}
+	for(i = 0; i < NOBJS; i++)
+		assert(objs[i][0] == (char)i && objs[i][obj_size(i) - 1] == (char)i);
+	a = dmm_region_alloc(region, 100000);
+	assert(a != NULL);
+	memset(a, 'a', 100000);
+	b = dmm_region_alloc(region, 16);
+	assert(b + 16 <= a || b >= a + 100000);
+
+	printf("nested savepoints free what was allocated inside them\n");
+	dmm_region_reset(region);
+	a = dmm_region_alloc(region, 64);
+	strcpy(a, "outer");
+	dmalloc_stats(&s);
+	outer = dmm_region_save(region);
+	b = dmm_region_alloc(region, 64);
+	strcpy(b, "inner");
+	inner = dmm_region_save(region);
+	for(i = 0; i < NOBJS; i++)
+		dmm_region_alloc(region, obj_size(i));
+	dmm_region_alloc(region, 100000);
+	dmm_region_restore(region, inner);
+	c = dmm_region_alloc(region, 64);
+	assert(c == b + 64 && "bumping resumes at the mark");
+	assert(strcmp(a, "outer") == 0 && strcmp(b, "inner") == 0);
+	dmm_region_restore(region, outer);
+	assert(dmm_region_alloc(region, 64) == b);
+	assert(strcmp(a, "outer") == 0);
+	dmalloc_stats(&r);
+	assert(r.in_use == s.in_use && "restoring the outer mark frees the blocks in between");
+
+	printf("destroy gives everything back\n");
+	dmm_region_destroy(region);
+	dmalloc_stats(&s);
+	assert(s.in_use == start.in_use);
+
+	printf("%d requests of %d objects, reset per request vs dfree per object\n", REQUESTS, NOBJS);
+	region = dmm_region_create(0);
+	begin = clock();
+	for(i = 0; i < REQUESTS; i++)
+		request(region);
+	t_region = (double)(clock() - begin) / CLOCKS_PER_SEC;
+	a = objs[0];
+	request(region);
+	assert(objs[0] == a && "a request fits the block kept by the last reset");
+	begin = clock();
+	for(i = 0; i < REQUESTS; i++)
+		request(NULL);
+	t_dmalloc = (double)(clock() - begin) / CLOCKS_PER_SEC;
+	dmm_region_destroy(region);
+	printf("region: %g seconds, dmalloc/dfree: %g seconds\n", t_region, t_dmalloc);
+
+	printf("Region testcases passed!\n");
+	(void)c;
+	exit(0);
+}
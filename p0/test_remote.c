@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "dmm.h"
+
+/*
+ * Cross-thread frees: the main thread allocates, a second thread (on
+ * another arena) frees everything. Its frees go onto the main arena's
+ * remote stack and the main thread's next allocations drain them, or
+ * the second thread does when it exits.
+ */
+
+#define NOBJS 4000
+#define ROUNDS 10
+
+static char *objs[NOBJS];
+
+static size_t obj_size(int i) {
+	/* small objects and arena chunks */
+	return i % 4 == 0 ? 1000 + i : 16 + i % 200;
+}
+
+static void *consumer(void *arg) {
+	int i;
+
+	for(i = 0; i < NOBJS; i++) {
+		assert(objs[i][0] == (char)i);
+		dfree(objs[i]);
+	}
+	return NULL;
+}
+
+static void produce() {
+	int i;
+
+	for(i = 0; i < NOBJS; i++) {
+		objs[i] = (char*)dmalloc(obj_size(i));
+		if(objs[i] == NULL)
+		{
+			fprintf(stderr,"call to dmalloc() failed\n");
+			fflush(stderr);
+			exit(1);
+		}
+		memset(objs[i], i, obj_size(i));
+	}
+}
+
+int main(int argc, char *argv[]) {
+	dmalloc_stats_t first, s;
+	pthread_t tid;
+	int r;
+
+	/* main thread on arena 0, each consumer on one of its own */
+	setenv("DMM_ARENAS", "16", 1);
+
+	printf("%d rounds: main allocates %d objects, another thread frees them\n", ROUNDS, NOBJS);
+	for(r = 0; r < ROUNDS; r++) {
+		produce();
+		if(r == 1)
+			dmalloc_stats(&first);
+		pthread_create(&tid, NULL, consumer, NULL);
+		pthread_join(tid, NULL);
+	}
+	produce();
+	dmalloc_stats(&s);
+	assert(s.remote_frees > 0);
+	assert(s.peak_heap_size < 2 * first.peak_heap_size && "the remote frees are reused");
+
+	printf("a consumer that exits drains what it freed, no allocation needed\n");
+	pthread_create(&tid, NULL, consumer, NULL);
+	pthread_join(tid, NULL);
+	dmalloc_stats(&s);
+	assert(s.remote_frees == (size_t)NOBJS * (ROUNDS + 1));
+
+	printf("Remote free testcases passed!\n");
+	exit(0);
+}
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "dmm.h"
+
+#define NOBJS 10000
+
+static char *objs[NOBJS];
+
+int main(int argc, char *argv[]) {
+	dmalloc_stats_t before, s;
+	char *array1, *array2;
+	size_t n;
+	int i, j;
+
+	printf("every size up to 256 bytes gets a slot of its class\n");
+	for(n = 1; n <= 256; n++) {
+		array1 = (char*)dmalloc(n);
+		array2 = (char*)dmalloc(n);
+		if(array1 == NULL || array2 == NULL)
+		{
+			fprintf(stderr,"call to dmalloc() failed\n");
+			fflush(stderr);
+			exit(1);
+		}
+		assert((uintptr_t)array1 % ALIGNMENT == 0);
+		assert(dmalloc_usable_size(array1) == ALIGN(n));
+		assert(array1 + ALIGN(n) <= array2 || array2 + ALIGN(n) <= array1);
+		memset(array1, 'a', n);
+		memset(array2, 'b', n);
+		dfree(array1);
+		dfree(array2);
+	}
+
+	printf("dmalloc(0) gets a slot of the smallest class\n");
+	array1 = (char*)dmalloc(0);
+	assert(array1 != NULL && dmalloc_usable_size(array1) == ALIGNMENT);
+	dfree(array1);
+
+	printf("no header per object: %d 16-byte objects take %d bytes of runs\n", NOBJS, NOBJS * 16);
+	dmalloc_stats(&before);
+	for(i = 0; i < NOBJS; i++) {
+		objs[i] = (char*)dmalloc(16);
+		assert(objs[i] != NULL);
+		memset(objs[i], i, 16);
+	}
+	dmalloc_stats(&s);
+	assert(s.heap_size - before.heap_size < NOBJS * 16 * 11 / 10);
+	for(i = 0; i < NOBJS; i++)
+		for(j = 0; j < 16; j++)
+			assert(objs[i][j] == (char)i);
+
+	printf("freed slots are reused\n");
+	dfree(objs[100]);
+	array1 = (char*)dmalloc(16);
+	assert(array1 == objs[100]);
+	for(i = 0; i < NOBJS; i++)
+		dfree(objs[i]);
+	dmalloc_stats(&before);
+	for(i = 0; i < NOBJS; i++)
+		objs[i] = (char*)dmalloc(16);
+	dmalloc_stats(&s);
+	assert(s.heap_size == before.heap_size && "the emptied runs are used again");
+	for(i = 0; i < NOBJS; i++)
+		dfree(objs[i]);
+
+	printf("drealloc keeps the slot while it fits and copies out of it otherwise\n");
+	array1 = (char*)dmalloc(100);
+	memset(array1, 'c', 100);
+	assert(drealloc(array1, 104) == array1);
+	array2 = (char*)drealloc(array1, 4000);
+	assert(array2 != NULL && array2 != array1);
+	for(i = 0; i < 100; i++)
+		assert(array2[i] == 'c');
+	array1 = (char*)drealloc(array2, 40);
+	assert(dmalloc_usable_size(array1) == 40);
+	for(i = 0; i < 40; i++)
+		assert(array1[i] == 'c');
+
+	printf("dcalloc zeroes a reused slot\n");
+	dfree(array1);
+	array1 = (char*)dcalloc(5, 8);
+	for(i = 0; i < 40; i++)
+		assert(array1[i] == 0);
+	dfree(array1);
+	assert(dcalloc(SIZE_MAX / 2, 4) == NULL);
+	array1 = (char*)dcalloc(0, 4);
+	array2 = (char*)dcalloc(4, 0);
+	assert(array1 != NULL && array2 != NULL && "an empty array is dmalloc(0)");
+	dfree(array1);
+	dfree(array2);
+
+	printf("Small object testcases passed!\n");
+	exit(0);
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+
+#include "dmm.h"
+
+static inline size_t fit_calls(dmalloc_stats_t *s) {
+	size_t n = 0;
+	int i;
+
+	for(i = 0; i < DMM_FIT_HIST; i++)
+		n += s->fit_hist[i];
+	return n;
+}
+
+/* sizes stay above the per-thread cache limit so every call reaches the heap */
+int main(int argc, char *argv[]) {
+	dmalloc_stats_t before, s;
+	char *array1, *array2, *array3, *big;
+
+	dmalloc_stats(&before);
+	assert(before.in_use == 0 && before.peak_in_use == 0);
+
+	printf("malloc(1000), malloc(2000), malloc(3000)\n");
+	array1 = (char*)dmalloc(1000);
+	array2 = (char*)dmalloc(2000);
+	array3 = (char*)dmalloc(3000);
+	if(array1 == NULL || array2 == NULL || array3 == NULL)
+	{
+		fprintf(stderr,"call to dmalloc() failed\n");
+		fflush(stderr);
+		exit(1);
+	}
+	dmalloc_stats(&s);
+	assert(s.in_use == dmalloc_usable_size(array1) + dmalloc_usable_size(array2) + dmalloc_usable_size(array3));
+	assert(s.peak_in_use == s.in_use);
+	assert(fit_calls(&s) == fit_calls(&before) + 3);
+	assert(s.sbrk_grows >= 1);
+
+	printf("free(array2), free(array1): the second free coalesces\n");
+	dfree(array2);
+	dfree(array1);
+	dmalloc_stats(&s);
+	assert(s.in_use == dmalloc_usable_size(array3));
+	assert(s.peak_in_use >= 6000);
+	assert(s.coalesces >= 1);
+	assert(s.free_blocks >= 1 && s.largest_free >= 3000);
+
+	printf("malloc(500) splits the freed chunk\n");
+	before = s;
+	array1 = (char*)dmalloc(500);
+	dmalloc_stats(&s);
+	assert(s.splits == before.splits + 1);
+	assert(s.in_use == before.in_use + dmalloc_usable_size(array1));
+
+	printf("malloc(1MB) is mmap'd and counted\n");
+	big = (char*)dmalloc(1024 * 1024);
+	assert(big != NULL);
+	dmalloc_stats(&s);
+	assert(s.in_use >= before.in_use + 1024 * 1024);
+	dfree(big);
+	dfree(array1);
+	dfree(array3);
+	dmalloc_stats(&s);
+	assert(s.in_use == 0);
+	assert(s.peak_in_use >= 1024 * 1024);
+
+	printf("Stats testcases passed!\n");
+	return 0;
+}
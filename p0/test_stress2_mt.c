@@ -0,0 +1,128 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "dmm.h"
+
+/*
+ * Multi-threaded variant of test_stress2: every thread runs the same random
+ * alloc/free loop on its own pointer array. Run with a thread count to get
+ * one line, or without arguments to sweep 1, 2, 4, 8 threads.
+ *
+ * $> gcc -I. -Wall -O2 -DNDEBUG -pthread -o test_stress2_mt test_stress2_mt.c dmm.c
+ * $> ./test_stress2_mt [threads] [max_alloc_size]
+ */
+
+#define BUFLEN (1000)
+
+#define LOOPCNT (500000)
+
+/* small objects are the case the per-thread caches are for */
+#define MAX_ALLOC_SIZE (256)
+
+#define MAX_THREADS (64)
+
+#define ALLOC_CONST	0.5
+
+static int max_alloc_size = MAX_ALLOC_SIZE;
+
+typedef struct worker {
+	pthread_t tid;
+	unsigned short seed[3];
+	int fail;
+} worker_t;
+
+static void *run(void *arg) {
+	worker_t *w = arg;
+	void *ptr[BUFLEN];
+	int i, itr, size;
+	double randvar;
+
+	for(i=0; i < BUFLEN; i++) {
+		ptr[i] = NULL;
+	}
+
+	for(i = 0; i < LOOPCNT; i++) {
+		/* erand48 keeps its state in the worker; random() would take a lock */
+		itr = (int)(erand48(w->seed) * BUFLEN);
+
+		randvar = erand48(w->seed);
+
+		if(randvar < ALLOC_CONST && ptr[itr] == NULL) {
+			size = (int)(erand48(w->seed) * max_alloc_size);
+			if(size <= 0)
+				continue;
+			ptr[itr] = dmalloc(size);
+			if(ptr[itr] == NULL) {
+				++w->fail;
+				continue;
+			}
+			memset(ptr[itr], itr, size);
+		} else if(randvar >= ALLOC_CONST && ptr[itr] != NULL) {
+			dfree(ptr[itr]);
+			ptr[itr] = NULL;
+		}
+	}
+
+	for(i=0; i < BUFLEN; i++) {
+		if(ptr[i] != NULL) {
+			dfree(ptr[i]);
+			ptr[i] = NULL;
+		}
+	}
+	return NULL;
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_threads(int nthreads) {
+	worker_t workers[MAX_THREADS];
+	double begin, time_spent;
+	int i, fail = 0;
+
+	begin = now();
+	for(i = 0; i < nthreads; i++) {
+		workers[i].seed[0] = 0x330e;
+		workers[i].seed[1] = i;
+		workers[i].seed[2] = i >> 16;
+		workers[i].fail = 0;
+		pthread_create(&workers[i].tid, NULL, run, &workers[i]);
+	}
+	for(i = 0; i < nthreads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		fail += workers[i].fail;
+	}
+	time_spent = now() - begin;
+
+	printf("Threads: %d, loop count: %d per thread, malloc failed: %d, wall time: %g seconds, throughput: %.0f ops/sec\n",
+		nthreads, LOOPCNT, fail, time_spent, (double)nthreads * LOOPCNT / time_spent);
+	return fail;
+}
+
+int main(int argc, char *argv[]) {
+	int n, fail = 0;
+
+	if(argc > 2)
+		max_alloc_size = atoi(argv[2]);
+
+	if(argc > 1) {
+		n = atoi(argv[1]);
+		assert(n > 0 && n <= MAX_THREADS);
+		fail = run_threads(n);
+	} else {
+		for(n = 1; n <= 8; n *= 2)
+			fail += run_threads(n);
+	}
+
+	print_freelist();
+	printf("Multi-threaded stress testcases2 %s!\n", fail ? "failed" : "passed");
+	return fail != 0;
+}
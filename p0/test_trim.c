@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h> //for exit
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#include "dmm.h"
+
+#define NBLOCKS 4000
+
+static char *blocks[NBLOCKS];
+
+/* resident set size in pages, or -1 where /proc is not available */
+static long rss_pages() {
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if(f == NULL)
+		return -1;
+	if(fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = -1;
+	fclose(f);
+	return resident;
+}
+
+/* sizes stay above the per-thread cache limit so every free reaches the heap */
+int main(int argc, char *argv[]) {
+	dmalloc_stats_t s;
+	char *high, *guard1, *guard2, *big;
+	long during, after;
+	int i;
+
+	printf("4000 x 2000 bytes, then free them all: the break moves back\n");
+	for(i = 0; i < NBLOCKS; i++) {
+		blocks[i] = (char*)dmalloc(2000);
+		if(blocks[i] == NULL)
+		{
+			fprintf(stderr,"call to dmalloc() failed\n");
+			fflush(stderr);
+			exit(1);
+		}
+		memset(blocks[i], i, 2000);
+	}
+	high = sbrk(0);
+	for(i = 0; i < NBLOCKS; i++)
+		dfree(blocks[i]);
+	dmalloc_stats(&s);
+	assert((char *)sbrk(0) < high - 4 * 1024 * 1024);
+	assert(s.trimmed >= 4 * 1024 * 1024);
+
+	printf("a large free chunk in the middle of the heap gives its pages back\n");
+	dmalloc_set_mmap_threshold((size_t)-1);
+	guard1 = (char*)dmalloc(1000);
+	big = (char*)dmalloc(8 * 1024 * 1024);
+	guard2 = (char*)dmalloc(1000);
+	assert(guard1 != NULL && big != NULL && guard2 != NULL);
+	memset(big, 'a', 8 * 1024 * 1024);
+	during = rss_pages();
+	dfree(big);
+	after = rss_pages();
+	dmalloc_stats(&s);
+	assert(s.madvised >= 8 * 1024 * 1024 - 2 * 4096);
+	if(during > 0)
+		assert(after < during - (4 * 1024 * 1024) / sysconf(_SC_PAGESIZE));
+	big = (char*)dmalloc(8 * 1024 * 1024);
+	assert(big != NULL);
+	memset(big, 'b', 8 * 1024 * 1024);
+	assert(big[8 * 1024 * 1024 - 1] == 'b');
+	dfree(big);
+
+	printf("dmalloc_trim(0) with only small free space left\n");
+	dfree(guard2);
+	dfree(guard1);
+	dmalloc_trim(0);
+	high = sbrk(0);
+	assert(dmalloc_trim(0) == 0 && "nothing left to release");
+	assert((char *)sbrk(0) == high);
+
+	printf("Trim testcases passed!\n");
+	(void)high; (void)after;
+	return 0;
+}
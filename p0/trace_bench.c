@@ -0,0 +1,224 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Trace-driven allocator benchmark: replays an allocation trace and reports
+ * throughput, peak heap size, peak utilization and per-operation latency.
+ * The allocator is picked at compile time:
+ *
+ * $> gcc -I. -Wall -O2 -DNDEBUG -pthread -o trace_bench trace_bench.c dmm.c
+ * $> gcc -I. -Wall -O2 -DBENCH_DMM1 -o trace_bench_dmm1 trace_bench.c dmm1.c segment.c
+ * $> gcc -I. -Wall -O2 -DBENCH_LIBC -o trace_bench_libc trace_bench.c
+ * $> ./trace_bench traces/binary-tree.trace
+ *
+ * A trace has one operation per line, lines starting with # are comments:
+ *
+ *   a <id> <size>   allocate size bytes and name the block id
+ *   f <id>          free block id
+ *   r <id> <size>   resize block id to size bytes
+ *
+ * Ids can be reused once freed. The peak heap is how far the allocator's
+ * heap grew: the break for glibc (kept off mmap so that everything shows
+ * up there), the segments and small-object runs for dmm.c (also kept off
+ * mmap) and the segment size for dmm1.c.
+ * Utilization is the peak of live requested bytes over the peak heap.
+ * Latencies include one clock_gettime call.
+ */
+
+#if defined(BENCH_LIBC)
+#include <malloc.h>
+#define ALLOCATOR "glibc"
+#define bench_malloc(n) malloc(n)
+#define bench_free(p) free(p)
+#define bench_realloc(p, old, n) realloc(p, n)
+#elif defined(BENCH_DMM1)
+#include "allocator.h"
+#include "segment.h"
+#define ALLOCATOR "dmm1"
+#define bench_malloc(n) dmalloc(n)
+#define bench_free(p) dfree(p)
+#define bench_realloc(p, old, n) copy_realloc(p, old, n)
+
+/* dmm1.c has no realloc */
+static void *copy_realloc(void *p, size_t old, size_t n) {
+	void *q = dmalloc(n);
+	if(q != NULL) {
+		memcpy(q, p, old < n ? old : n);
+		dfree(p);
+	}
+	return q;
+}
+#else
+#include "dmm.h"
+#define ALLOCATOR "dmm"
+#define bench_malloc(n) dmalloc(n)
+#define bench_free(p) dfree(p)
+#define bench_realloc(p, old, n) drealloc(p, n)
+#endif
+
+typedef struct op {
+	char type;
+	int id;
+	size_t size;
+} op_t;
+
+#if defined(BENCH_LIBC)
+static char *heap_base;
+#endif
+
+static void heap_begin() {
+#if defined(BENCH_LIBC)
+	mallopt(M_MMAP_MAX, 0);
+	heap_base = sbrk(0);
+#elif defined(BENCH_DMM1)
+	dmalloc_init();
+#else
+	dmalloc_set_mmap_threshold(SIZE_MAX);
+#endif
+}
+
+static size_t heap_size() {
+#if defined(BENCH_LIBC)
+	return (char *)sbrk(0) - heap_base;
+#elif defined(BENCH_DMM1)
+	return heap_segment_size();
+#else
+	dmalloc_stats_t stats;
+
+	dmalloc_stats(&stats);
+	return stats.heap_size;
+#endif
+}
+
+static op_t *read_trace(const char *path, int *nops, int *nids) {
+	FILE *f = fopen(path, "r");
+	char line[256];
+	op_t *ops = NULL;
+	int n = 0, cap = 0, fields;
+
+	if(f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	*nids = 0;
+	while(fgets(line, sizeof(line), f) != NULL) {
+		if(line[0] == '#' || line[0] == '\n')
+			continue;
+		if(n == cap) {
+			cap = cap ? cap * 2 : 4096;
+			ops = realloc(ops, cap * sizeof(op_t));
+		}
+		ops[n].size = 0;
+		fields = sscanf(line, "%c %d %zu", &ops[n].type, &ops[n].id, &ops[n].size);
+		if(fields < 2 || ops[n].id < 0 || (ops[n].type != 'f' && fields < 3)
+			|| (ops[n].type != 'a' && ops[n].type != 'f' && ops[n].type != 'r')) {
+			fprintf(stderr, "%s: bad line: %s", path, line);
+			fclose(f);
+			free(ops);
+			return NULL;
+		}
+		if(ops[n].id >= *nids)
+			*nids = ops[n].id + 1;
+		n++;
+	}
+	fclose(f);
+	*nops = n;
+	return ops;
+}
+
+static inline uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	op_t *ops;
+	void **blocks;
+	size_t *sizes;
+	uint32_t *lat;
+	size_t live = 0, peak_live = 0, heap, peak_heap = 0;
+	uint64_t t, total = 0;
+	int nops, nids, i, id;
+	void *p;
+
+	if(argc != 2) {
+		fprintf(stderr, "usage: %s trace\n", argv[0]);
+		return 1;
+	}
+	ops = read_trace(argv[1], &nops, &nids);
+	if(ops == NULL)
+		return 1;
+	blocks = calloc(nids, sizeof(void *));
+	sizes = calloc(nids, sizeof(size_t));
+	lat = malloc(nops * sizeof(uint32_t));
+	/* the bookkeeping above comes from the system malloc, get it before
+	 * taking the baseline */
+	fflush(stdout);
+	heap_begin();
+
+	for(i = 0; i < nops; i++) {
+		id = ops[i].id;
+		switch(ops[i].type) {
+		case 'a':
+			t = now_ns();
+			p = bench_malloc(ops[i].size);
+			lat[i] = now_ns() - t;
+			if(p == NULL)
+				goto fail;
+			blocks[id] = p;
+			sizes[id] = ops[i].size;
+			live += ops[i].size;
+			memset(p, id, ops[i].size);
+			break;
+		case 'f':
+			if(blocks[id] == NULL) {
+				fprintf(stderr, "op %d frees unknown id %d\n", i, id);
+				return 1;
+			}
+			t = now_ns();
+			bench_free(blocks[id]);
+			lat[i] = now_ns() - t;
+			blocks[id] = NULL;
+			live -= sizes[id];
+			break;
+		case 'r':
+			t = now_ns();
+			p = bench_realloc(blocks[id], sizes[id], ops[i].size);
+			lat[i] = now_ns() - t;
+			if(p == NULL)
+				goto fail;
+			if(ops[i].size > sizes[id])
+				memset((char *)p + sizes[id], id, ops[i].size - sizes[id]);
+			blocks[id] = p;
+			live += ops[i].size - sizes[id];
+			sizes[id] = ops[i].size;
+			break;
+		}
+		total += lat[i];
+		if(live > peak_live)
+			peak_live = live;
+		heap = heap_size();
+		if(heap > peak_heap)
+			peak_heap = heap;
+	}
+
+	qsort(lat, nops, sizeof(uint32_t), cmp_u32);
+	printf("%-6s %-24s ops: %7d  ops/sec: %10.0f  peak heap: %9zu  utilization: %5.1f%%  p50: %4u ns  p99: %5u ns\n",
+		ALLOCATOR, argv[1], nops, nops / (total / 1e9), peak_heap,
+		100.0 * peak_live / peak_heap, lat[nops / 2], lat[(int)(nops * 0.99)]);
+	return 0;
+
+fail:
+	fprintf(stderr, "op %d: allocation of %zu bytes failed\n", i, ops[i].size);
+	return 1;
+}
@@ -0,0 +1,180 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Writes the synthetic allocation traces in traces/ to stdout (see
+ * trace_bench.c for the format). The traces are checked in; this is only
+ * needed to regenerate them.
+ *
+ * $> gcc -Wall -O2 -o trace_gen trace_gen.c
+ * $> ./trace_gen binary-tree|realloc|prodcons|frag > traces/<name>.trace
+ *
+ *   binary-tree  a long-lived tree plus short-lived trees of depth 4-10
+ *                that are built and torn down in post-order
+ *   realloc      64 string-builder buffers growing by small steps up to
+ *                64KB, occasionally shrunk or dropped
+ *   prodcons     a FIFO of 16-4096 byte messages, freed in arrival order
+ *                in bursts
+ *   frag         rounds of short-lived blocks between long-lived pins; each
+ *                round asks for bigger blocks than the holes the last left
+ */
+
+#define MAX_IDS (1 << 16)
+
+static int free_ids[MAX_IDS];
+static int nfree_ids = 0;
+static int next_id = 0;
+static long nops = 0;
+
+#define RAND() ((double)random()/RAND_MAX)
+
+static int rand_range(int lo, int hi) {
+	return lo + (int)(RAND() * (hi - lo + 1)) % (hi - lo + 1);
+}
+
+static int alloc(size_t size) {
+	int id = nfree_ids > 0 ? free_ids[--nfree_ids] : next_id++;
+	printf("a %d %zu\n", id, size);
+	nops++;
+	return id;
+}
+
+static void release(int id) {
+	printf("f %d\n", id);
+	free_ids[nfree_ids++] = id;
+	nops++;
+}
+
+static void resize(int id, size_t size) {
+	printf("r %d %zu\n", id, size);
+	nops++;
+}
+
+/* allocates a tree of the given depth and frees it bottom-up */
+static void tree(int depth) {
+	int id = alloc(rand_range(24, 48));
+	if(depth > 0) {
+		tree(depth - 1);
+		tree(depth - 1);
+	}
+	release(id);
+}
+
+/* allocates a tree that stays live, returns the number of nodes */
+static int long_lived_tree(int depth, int *ids, int n) {
+	ids[n++] = alloc(rand_range(24, 48));
+	if(depth > 0) {
+		n = long_lived_tree(depth - 1, ids, n);
+		n = long_lived_tree(depth - 1, ids, n);
+	}
+	return n;
+}
+
+static void gen_binary_tree() {
+	static int ids[1 << 11];
+	int i, n, depth;
+
+	n = long_lived_tree(10, ids, 0);
+	for(i = 0; i < 20; i++) {
+		for(depth = 4; depth <= 10; depth += 3)
+			tree(depth);
+	}
+	for(i = 0; i < n; i++)
+		release(ids[i]);
+}
+
+#define NBUFS 64
+#define MAX_BUF (64 * 1024)
+
+static void gen_realloc() {
+	int ids[NBUFS];
+	size_t sizes[NBUFS];
+	int i, b;
+
+	for(b = 0; b < NBUFS; b++) {
+		sizes[b] = rand_range(8, 64);
+		ids[b] = alloc(sizes[b]);
+	}
+	for(i = 0; i < 50000; i++) {
+		b = rand_range(0, NBUFS - 1);
+		if(RAND() < 0.02 || sizes[b] > MAX_BUF) {
+			/* done with this buffer, start a new one */
+			release(ids[b]);
+			sizes[b] = rand_range(8, 64);
+			ids[b] = alloc(sizes[b]);
+		} else if(RAND() < 0.05) {
+			/* shrink-to-fit */
+			sizes[b] = sizes[b] / 2 + 1;
+			resize(ids[b], sizes[b]);
+		} else {
+			sizes[b] += rand_range(1, 512);
+			resize(ids[b], sizes[b]);
+		}
+	}
+	for(b = 0; b < NBUFS; b++)
+		release(ids[b]);
+}
+
+#define QUEUE_LEN 4096
+
+static void gen_prodcons() {
+	int queue[QUEUE_LEN];
+	int head = 0, tail = 0, i, burst;
+
+	for(i = 0; i < 1000; i++) {
+		/* producer: a burst of messages with log-uniform sizes */
+		for(burst = rand_range(1, 60); burst > 0 && tail - head < QUEUE_LEN; burst--)
+			queue[tail++ % QUEUE_LEN] = alloc((size_t)16 << rand_range(0, 8));
+		/* consumer: frees from the head in arrival order */
+		for(burst = rand_range(1, 60); burst > 0 && head < tail; burst--)
+			release(queue[head++ % QUEUE_LEN]);
+	}
+	while(head < tail)
+		release(queue[head++ % QUEUE_LEN]);
+}
+
+#define FRAG_BLOCKS 2000
+
+static void gen_frag() {
+	static int pins[FRAG_BLOCKS * 8];
+	int blocks[FRAG_BLOCKS];
+	int npins = 0, round, i;
+	size_t size = 16;
+
+	for(round = 0; round < 8; round++) {
+		/* short-lived blocks with a small pin after each one */
+		for(i = 0; i < FRAG_BLOCKS; i++) {
+			blocks[i] = alloc(size);
+			pins[npins++] = alloc(16);
+		}
+		/* freeing them leaves holes of exactly `size' bytes that the
+		 * next round's bigger requests cannot use */
+		for(i = 0; i < FRAG_BLOCKS; i++)
+			release(blocks[i]);
+		size = size * 2 + 8;
+	}
+	for(i = 0; i < npins; i++)
+		release(pins[i]);
+}
+
+int main(int argc, char *argv[]) {
+	const char *name = argc > 1 ? argv[1] : "";
+
+	srandom(310);
+	printf("# %s\n", name);
+	if(strcmp(name, "binary-tree") == 0)
+		gen_binary_tree();
+	else if(strcmp(name, "realloc") == 0)
+		gen_realloc();
+	else if(strcmp(name, "prodcons") == 0)
+		gen_prodcons();
+	else if(strcmp(name, "frag") == 0)
+		gen_frag();
+	else {
+		fprintf(stderr, "usage: %s binary-tree|realloc|prodcons|frag\n", argv[0]);
+		return 1;
+	}
+	fprintf(stderr, "%s: %ld ops, %d ids\n", name, nops, next_id);
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dmm.h"
+
+/*
+ * Memory utilization report: replays a random alloc/free workload and
+ * compares the peak number of requested bytes that were live at the same
+ * time with the peak size of the heap (the main arena's segments plus the
+ * small-object runs, from dmalloc_stats). Requests stay below the mmap
+ * threshold, so nothing bypasses the heap.
+ *
+ * $> gcc -I. -Wall -O2 -DNDEBUG -pthread -DMAX_HEAP_SIZE='(1024*1024*4)' -o util_report util_report.c dmm.c
+ * $> ./util_report stress2|small|medium
+ *
+ *   stress2  test_stress2's workload: 1000 slots, sizes up to MAX_HEAP_SIZE/100
+ *   small    100000 slots of 16-64 byte objects
+ *   medium   10000 slots of 1-1024 byte objects
+ */
+
+#define ALLOC_CONST	0.5
+
+#define RAND() ((double)random()/RAND_MAX)
+
+int main(int argc, char *argv[]) {
+	const char *name = argc > 1 ? argv[1] : "stress2";
+	int buflen, loopcnt, minsize, maxsize;
+	void **ptr;
+	size_t *sizes;
+	size_t live = 0, peak_live = 0;
+	dmalloc_stats_t stats;
+	int i, itr, size;
+
+	if(strcmp(name, "stress2") == 0) {
+		buflen = 1000; loopcnt = 50000; minsize = 1; maxsize = MAX_HEAP_SIZE/100;
+	} else if(strcmp(name, "small") == 0) {
+		buflen = 100000; loopcnt = 1000000; minsize = 16; maxsize = 64;
+	} else if(strcmp(name, "medium") == 0) {
+		buflen = 10000; loopcnt = 200000; minsize = 1; maxsize = 1024;
+	} else {
+		fprintf(stderr, "usage: %s stress2|small|medium\n", argv[0]);
+		return 1;
+	}
+
+	ptr = calloc(buflen, sizeof(void *));
+	sizes = calloc(buflen, sizeof(size_t));
+	printf("workload: %s, slots: %d, ops: %d, sizes: %d-%d\n", name, buflen, loopcnt, minsize, maxsize);
+
+	for(i = 0; i < loopcnt; i++) {
+		itr = (int)(RAND() * (buflen - 1));
+
+		if(RAND() < ALLOC_CONST && ptr[itr] == NULL) {
+			size = minsize + (int)(RAND() * (maxsize - minsize));
+			if(size <= 0)
+				continue;
+			ptr[itr] = dmalloc(size);
+			if(ptr[itr] == NULL) {
+				fprintf(stderr, "malloc at iteration %d failed for size %d\n", i, size);
+				return 1;
+			}
+			sizes[itr] = size;
+			live += size;
+			if(live > peak_live)
+				peak_live = live;
+		} else if(ptr[itr] != NULL) {
+			dfree(ptr[itr]);
+			ptr[itr] = NULL;
+			live -= sizes[itr];
+		}
+	}
+
+	dmalloc_stats(&stats);
+	printf("peak live bytes: %zu, peak heap bytes: %zu, utilization: %.1f%%\n",
+		peak_live, stats.peak_heap_size, 100.0 * peak_live / stats.peak_heap_size);
+	return 0;
+}
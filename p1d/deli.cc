@@ -12,6 +12,10 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <list>
+#ifndef DMM_NO_POOL
+#include "dmm_allocator.h"
+#endif
 using namespace std;
 //using deque instead of queue so i can initiate it
 // using vector instead of map so can ensure insertion order of sandwiches on the corkboard when 2 sandwiches have the same id
@@ -44,11 +48,26 @@ struct SANDWICH_ORDER{
   int cid; //cashier id
 };
 
+//the board and the maps allocate from dmm: queue and map nodes from node pools, the board's array with dmalloc
+//(-DDMM_NO_POOL for the std allocator). The dmm allocators are not preemption-safe (see dmm_allocator.h): deli
+//never calls start_preemptions, build with -DDMM_NO_POOL before adding it
+#ifndef DMM_NO_POOL
+typedef vector<SANDWICH_ORDER*, dmm_allocator<SANDWICH_ORDER*> > order_board;
+typedef queue<SANDWICH_ORDER*, list<SANDWICH_ORDER*, dmm_pool_allocator<SANDWICH_ORDER*> > > order_queue;
+typedef map<int, int, less<int>, dmm_pool_allocator<pair<const int, int> > > cashier_map;
+typedef map<int, order_queue, less<int>, dmm_pool_allocator<pair<const int, order_queue> > > order_map;
+#else
+typedef vector<SANDWICH_ORDER*> order_board;
+typedef queue<SANDWICH_ORDER*> order_queue;
+typedef map<int, int> cashier_map;
+typedef map<int, order_queue> order_map;
+#endif
+
 //An arraylist of index for keeping insersion order of sandwich orders
-vector<SANDWICH_ORDER*> CORK_BOARD; //int = order_number, 
+order_board CORK_BOARD; //int = order_number, 
 
 //A Map of cashier id to the status of this cashier if its previous order has been done yet
-map<int, int> CASHIER_MAP; //key = cashier_id, value = 0 if can push order, 1 if cannot, 2 if done
+cashier_map CASHIER_MAP; //key = cashier_id, value = 0 if can push order, 1 if cannot, 2 if done
 
 //the max_order the cork board can hold, min(max_order, cashier_count) is used when numbers start changing
 int max_order;
@@ -60,7 +79,7 @@ int cashier_count;
 int previousSandwich = -1;
 
 //a map of all orders that need to be done by master based on each cashier
-map<int, queue<SANDWICH_ORDER*> > ORDER_RECEIVED; //int = cashier id, queue is a queue of sandwich orders: order_q
+order_map ORDER_RECEIVED; //int = cashier id, queue is a queue of sandwich orders: order_q
 
 
 int main(int argc, char *argv[]);
@@ -87,7 +106,7 @@ int main(int argc, char *argv[]){
     ifstream sw_input;
     int new_cid = i - 2; // cashier id
     string new_sid_s; // sandwich id in string
-    queue<SANDWICH_ORDER*> new_order_q; // queue of order for this cashier
+    order_queue new_order_q; // queue of order for this cashier
 
     sw_input.open(argv[i]);
 
@@ -104,7 +123,7 @@ int main(int argc, char *argv[]){
       }
       sw_input.close();
       //where all inputs of cashier and their orders are stored
-      ORDER_RECEIVED.insert(pair<int, queue<SANDWICH_ORDER*> >(new_cid, new_order_q));
+      ORDER_RECEIVED.insert(pair<int, order_queue>(new_cid, new_order_q));
     }else{
       //cout << "\nsw input not open";
     }
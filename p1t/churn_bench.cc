@@ -0,0 +1,50 @@
+#include <iostream>
+#include <time.h>
+#include <sys/resource.h>
+#include "thread.h"
+using namespace std;
+
+// Thread churn benchmark: short-lived threads created in batches, each one exiting right away, like a server that
+// spawns a thread per request. Prints the cost of a create and exit pair and the page faults they took.
+//
+// g++ -O2 -I../p0 -o churn_bench thread.cc churn_bench.cc ../p0/dmm.o libinterrupt.a -ldl -pthread
+
+#define THREADS 200000
+#define BATCH 16
+
+int finished = 0;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long minor_faults() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_minflt;
+}
+
+void request(void* arg) {
+  finished++;
+}
+
+void parent(void* arg) {
+  double begin = now();
+  long faults = minor_faults();
+
+  for (int i = 0; i < THREADS; i += BATCH) {
+    for (int j = 0; j < BATCH; j++) {
+      thread_create(request, NULL);
+    }
+    // The batch runs and exits before the parent is back.
+    thread_yield();
+  }
+  cout << finished << " threads: " << (now() - begin) / THREADS << " ns per create and exit, "
+       << (double) (minor_faults() - faults) / THREADS << " page faults per thread\n";
+}
+
+int main() {
+  thread_libinit(parent, NULL);
+}
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <cstdlib>
+#include <time.h>
+#include <sys/resource.h>
+#include "thread.h"
+using namespace std;
+
+// Idle thread benchmark: many threads that each block on a CV right away, like a server with a thread per mostly
+// idle connection. Prints the time to start them and the memory they take.
+//
+// g++ -O2 -I../p0 -o idle_bench thread.cc idle_bench.cc ../p0/dmm.o libinterrupt.a -ldl -pthread
+// ./idle_bench [threads [stack size [guard size]]]
+//
+// More than about 30000 threads need guard size 0, each guard page is a kernel memory map of its own.
+
+unsigned int lock1 = 1;
+unsigned int cond1 = 1;
+int waiting = 0;
+long threads = 100000;
+thread_attr_t attrs;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static long max_rss_kb() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+void idle(void* arg) {
+  thread_lock(lock1);
+  waiting++;
+  thread_wait(lock1, cond1);
+  waiting--;
+  thread_unlock(lock1);
+}
+
+void parent(void* arg) {
+  long rss = max_rss_kb();
+  double begin = now();
+
+  for (long i = 0; i < threads; i++) {
+    if (thread_create_ex(idle, NULL, &attrs) < 0) {
+      cout << "thread_create_ex failed after " << i << " threads\n";
+      break;
+    }
+  }
+  // Every thread runs up to its thread_wait before the parent is back.
+  thread_yield();
+  cout << waiting << " idle threads with " << attrs.stack_size << " byte stacks: "
+       << (now() - begin) / waiting << " ns per thread, " << (max_rss_kb() - rss) * 1024.0 / waiting
+       << " bytes of memory per thread\n";
+
+  thread_lock(lock1);
+  thread_broadcast(lock1, cond1);
+  thread_unlock(lock1);
+}
+
+int main(int argc, char** argv) {
+  thread_attr_init(&attrs);
+  attrs.stack_size = 65536;
+  attrs.guard_size = 0;
+  if (argc > 1) {
+    threads = atol(argv[1]);
+  }
+  if (argc > 2) {
+    attrs.stack_size = atol(argv[2]);
+  }
+  if (argc > 3) {
+    attrs.guard_size = atol(argv[3]);
+  }
+  thread_libinit(parent, NULL);
+}
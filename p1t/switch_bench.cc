@@ -0,0 +1,64 @@
+#include <iostream>
+#include <time.h>
+#include "thread.h"
+using namespace std;
+
+// Context switch microbenchmark: the cost of a thread_yield between two threads and of a lock and CV round trip
+// between two threads, in nanoseconds. Build it twice to compare the switch implementations:
+//
+// g++ -O2 -I../p0 -o switch_bench thread.cc switch_bench.cc ../p0/dmm.o libinterrupt.a -ldl -pthread
+// g++ -O2 -DTHREAD_UCONTEXT -I../p0 -o switch_bench_uc thread.cc switch_bench.cc ../p0/dmm.o libinterrupt.a -ldl -pthread
+
+#define YIELDS 1000000
+#define ROUNDS 200000
+
+unsigned int lock1 = 1;
+unsigned int cond1 = 1;
+int turn = 0;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Yields YIELDS times; with two of these on the ready queue every yield switches to the other one.
+void yielder(void* arg) {
+  for (int i = 0; i < YIELDS; i++) {
+    thread_yield();
+  }
+}
+
+// Waits for its turn, passes it on and signals the other thread: every round blocks each thread once in
+// thread_wait and hands the lock over twice.
+void pinger(void* arg) {
+  long me = (long) arg;
+  thread_lock(lock1);
+  for (int i = 0; i < ROUNDS; i++) {
+    while (turn != me) {
+      thread_wait(lock1, cond1);
+    }
+    turn = 1 - me;
+    thread_signal(lock1, cond1);
+  }
+  thread_unlock(lock1);
+}
+
+void parent(void* arg) {
+  double begin;
+
+  thread_create(yielder, NULL);
+  begin = now();
+  yielder(NULL);
+  // Both yielders take turns, so the time covers 2 * YIELDS yields.
+  cout << "thread_yield: " << (now() - begin) / (2.0 * YIELDS) << " ns per yield\n";
+
+  thread_create(pinger, (void*) 1);
+  begin = now();
+  pinger((void*) 0);
+  cout << "lock and CV handoff: " << (now() - begin) / ROUNDS << " ns per round trip\n";
+}
+
+int main() {
+  thread_libinit(parent, NULL);
+}
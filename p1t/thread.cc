@@ -1,118 +1,668 @@
 #include <cstdlib>
+#include <csignal>
+#include <stdint.h>
+#include <new>
+#include <atomic>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <ucontext.h>
 #include <queue>
+#include <list>
 #include <iterator>
 #include <map>
 #include <iostream>
 #include "interrupt.h"
 #include "thread.h"
+#ifndef DMM_NO_POOL
+#include "dmm_allocator.h"
+#endif
 using namespace std;
 
 
 static void STUB(thread_startfunc_t func, void* arg);
 int thread_libinit(thread_startfunc_t func, void *arg); //want to exit
 int thread_create(thread_startfunc_t func, void *arg); //want to exit
+int thread_create_ex(thread_startfunc_t func, void *arg, const thread_attr_t *attrs);
+void thread_attr_init(thread_attr_t *attrs);
 int thread_yield(void); // call switch
 int thread_lock(unsigned int lock); //call switch
 int thread_unlock(unsigned int lock);
 int thread_wait(unsigned int lock, unsigned int cond); //call switch
 int thread_signal(unsigned int lock, unsigned int cond);
 int thread_broadcast(unsigned int lock, unsigned int cond);
-static void cleanup();
+static void after_switch();
+static void schedule();
+static void finish();
 static void process(thread_startfunc_t func, void* arg);
-static void swapToSwitchThread();
-static void switchtorunningthread();
 
-// TCB contains user context and thread status.
+// Finished threads with the default stack and guard sizes kept for reuse by thread_create, -DTHREAD_POOL_SIZE=0
+// deletes every finished thread.
+#ifndef THREAD_POOL_SIZE
+#define THREAD_POOL_SIZE 64
+#endif
+
+// Smallest stack thread_create_ex gives a thread.
+#define THREAD_STACK_MIN 16384
+
+// Most kernel threads THREAD_WORKERS can ask for.
+#ifndef THREAD_MAX_WORKERS
+#define THREAD_MAX_WORKERS 64
+#endif
+
+// Stripes the lock and CV maps are split over.
+#define SYNC_STRIPE_COUNT 64
+
+// TCB contains user context and thread status. It lives in one mapping with its stack, at the top end of it: the
+// guard pages, then the stack, then the TCB. The stack grows down from right below the TCB.
 struct TCB {
-  ucontext_t* ucontext; // Contains stack pointer to simulate thread switching.
+#ifndef THREAD_UCONTEXT
+  void* sp; // Saved stack pointer; ctx_switch keeps the registers on the thread's own stack.
+#else
+  ucontext_t ucontext; // Contains stack pointer to simulate thread switching.
+#endif
+  char* stack; // Lowest address of the stack, right above the guard pages.
+  char* map; // Start of the mapping.
+  size_t map_size;
+  bool poolable; // Default stack and guard sizes, so any thread_create can reuse it.
+  TCB* next_free; // Next TCB in the pool.
+  bool alarm_blocked; // Switched away inside the SIGALRM handler, so SIGALRM is blocked until it returns.
   int status; // 0 for not finished, 3 for cleanup (1 and 2 were supposed to be for lock/CV block respectivelty but not implemented)
 };
 
-// Global variable keeps tracking of the currently running thread.
-static TCB* RUNNING_THREAD;
+typedef void (*thread_entry_t)(thread_startfunc_t, void*);
+
+#ifndef THREAD_UCONTEXT
+// Context switch for x86-64 System V. A thread only ever switches by calling ctx_switch, so only what a call must
+// preserve is saved: the callee-saved registers, the stack pointer and the FPU control words (MXCSR and the x87
+// control word). There is no sigprocmask syscall as in swapcontext. ctx_switch pushes them on the old stack, stores
+// the stack pointer in *save_sp and pops the new thread's from load_sp. A new thread's stack is laid out as if it
+// had called ctx_switch, with ctx_start as the return address and the entry, func and arg in r12, r13 and r14.
+// -DTHREAD_UCONTEXT builds the old swapcontext switch.
+extern "C" void ctx_switch(void** save_sp, void* load_sp);
+extern "C" void ctx_start();
+asm(
+  ".text\n"
+  ".p2align 4\n"
+  "ctx_switch:\n"
+  "  pushq %rbp\n"
+  "  pushq %rbx\n"
+  "  pushq %r12\n"
+  "  pushq %r13\n"
+  "  pushq %r14\n"
+  "  pushq %r15\n"
+  "  subq $16, %rsp\n"
+  "  stmxcsr 8(%rsp)\n"
+  "  fnstcw (%rsp)\n"
+  "  movq %rsp, (%rdi)\n"
+  "  movq %rsi, %rsp\n"
+  "  ldmxcsr 8(%rsp)\n"
+  "  fldcw (%rsp)\n"
+  "  addq $16, %rsp\n"
+  "  popq %r15\n"
+  "  popq %r14\n"
+  "  popq %r13\n"
+  "  popq %r12\n"
+  "  popq %rbx\n"
+  "  popq %rbp\n"
+  "  ret\n"
+  "ctx_start:\n"
+  "  movq %r13, %rdi\n"
+  "  movq %r14, %rsi\n"
+  "  jmp *%r12\n"
+);
+
+// Words ctx_switch keeps on a stack: FPU control words (2), r15, r14, r13, r12, rbx, rbp, return address.
+static const int CTX_FRAME_WORDS = 9;
+
+// Makes the thread's stack start in entry(func, arg) on the next switch to it.
+static void context_init(TCB* thread, thread_entry_t entry, thread_startfunc_t func, void* arg) {
+  // The word above the frame is a null return address for entry, which leaves the stack 16-byte aligned on entry
+  // as the ABI requires.
+  void** top = (void**) (((uintptr_t) thread) & ~(uintptr_t) 15) - 1;
+  void** frame = top - CTX_FRAME_WORDS;
+  unsigned int mxcsr;
+  unsigned short fcw;
+
+  __asm__ ("stmxcsr %0" : "=m" (mxcsr));
+  __asm__ ("fnstcw %0" : "=m" (fcw));
+  frame[0] = (void*) (uintptr_t) fcw;
+  frame[1] = (void*) (uintptr_t) mxcsr;
+  frame[2] = NULL; // r15
+  frame[3] = (void*) arg; // r14
+  frame[4] = (void*) func; // r13
+  frame[5] = (void*) entry; // r12
+  frame[6] = NULL; // rbx
+  frame[7] = NULL; // rbp, ends backtraces here
+  frame[8] = (void*) ctx_start;
+  *top = NULL;
+  thread->sp = frame;
+}
+
+static void context_swap(TCB* from, TCB* to) {
+  ctx_switch(&from->sp, to->sp);
+}
+#else
+static void context_init(TCB* thread, thread_entry_t entry, thread_startfunc_t func, void* arg) {
+  getcontext(&thread->ucontext);
+  thread->ucontext.uc_stack.ss_sp = thread->stack;
+  thread->ucontext.uc_stack.ss_size = (char*) thread - thread->stack;
+  thread->ucontext.uc_stack.ss_flags = 0;
+  thread->ucontext.uc_link = NULL;
+  makecontext(&thread->ucontext, (void (*)()) entry, 2, func, arg);
+}
+
+static void context_swap(TCB* from, TCB* to) {
+  swapcontext(&from->ucontext, &to->ucontext);
+}
+#endif
+
+// Kernel threads running the threads, 1 unless THREAD_WORKERS is set (see thread_libinit).
+static int WORKER_COUNT = 1;
+
+static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Guards a sync stripe against the other workers; with one worker interrupts alone make the library atomic and it
+// is never taken. It may be released by another thread than the one that took it: a thread blocking on a lock or CV
+// keeps the stripe until it has switched away, and the thread switched to releases it.
+struct spin_lock {
+  atomic<bool> held;
+
+  void lock() {
+    if (WORKER_COUNT == 1) {
+      return;
+    }
+    for (int spins = 1; held.exchange(true, memory_order_acquire); spins++) {
+      // The holder may be a kernel thread the kernel switched out, so stop spinning now and then.
+      while (held.load(memory_order_relaxed)) {
+        if (spins++ % 64 == 0) {
+          sched_yield();
+        } else {
+          cpu_relax();
+        }
+      }
+    }
+  }
+
+  void unlock() {
+    held.store(false, memory_order_release);
+  }
+};
+
+// Ready threads of a worker: a Chase-Lev work-stealing deque. Only the worker pushes, at the bottom, without
+// a lock. Threads are taken from the top with a compare-and-swap, by thieves and by the worker itself: taking the
+// oldest thread keeps each worker's threads in FIFO order as the single ready queue did, so a yield lets the others
+// run (a pop from the bottom would run the yielding thread again at once). The ring of slots doubles when it is
+// full. A replaced ring is kept, since a thief may still be reading it.
+struct tcb_deque {
+  struct ring {
+    long size; // Power of 2.
+    atomic<TCB*>* slots;
+    ring* older; // The ring this one replaced.
+  };
+
+  atomic<long> top;
+  atomic<long> bottom;
+  atomic<ring*> array;
+
+  // Pushes a thread at the bottom. Only the deque's worker may call it. Throws bad_alloc.
+  void push(TCB* thread) {
+    long b = bottom.load(memory_order_relaxed);
+    long t = top.load(memory_order_acquire);
+    ring* r = array.load(memory_order_relaxed);
+
+    if (r == NULL || b - t >= r->size) {
+      ring* bigger = new ring;
+      bigger->size = r == NULL ? 64 : 2 * r->size;
+      bigger->slots = new atomic<TCB*> [bigger->size];
+      bigger->older = r;
+      for (long i = t; i < b; i++) {
+        bigger->slots[i & (bigger->size - 1)].store(r->slots[i & (r->size - 1)].load(memory_order_relaxed),
+                                                    memory_order_relaxed);
+      }
+      array.store(bigger, memory_order_release);
+      r = bigger;
+    }
+    r->slots[b & (r->size - 1)].store(thread, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    bottom.store(b + 1, memory_order_relaxed);
+  }
+
+  // Takes the thread at the top, or returns NULL if the deque is empty. Any worker may call it.
+  TCB* take() {
+    if (WORKER_COUNT == 1) {
+      // Nobody else takes: no fence and no compare-and-swap.
+      long t = top.load(memory_order_relaxed);
+      if (t >= bottom.load(memory_order_relaxed)) {
+        return NULL;
+      }
+      ring* r = array.load(memory_order_relaxed);
+      top.store(t + 1, memory_order_relaxed);
+      return r->slots[t & (r->size - 1)].load(memory_order_relaxed);
+    }
+    for (;;) {
+      long t = top.load(memory_order_acquire);
+      atomic_thread_fence(memory_order_seq_cst);
+      long b = bottom.load(memory_order_acquire);
+
+      if (t >= b) {
+        return NULL;
+      }
+      ring* r = array.load(memory_order_acquire);
+      TCB* thread = r->slots[t & (r->size - 1)].load(memory_order_relaxed);
+      if (top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return thread;
+      }
+      // Another worker took it first.
+    }
+  }
+
+  bool empty() {
+    return bottom.load(memory_order_acquire) <= top.load(memory_order_acquire);
+  }
+};
+
+// A kernel thread running threads. Each worker has its own ready deque and its own pool of finished threads; a
+// worker without ready threads steals from the others.
+struct alignas(64) Worker {
+  // Threads which are ready on this worker.
+  tcb_deque ready;
+
+  // The currently running thread.
+  TCB* running;
+
+  // Thread which runs when nothing is ready: it steals or waits for work, and ends the program once no thread can
+  // run. Threads otherwise switch straight to each other.
+  TCB* idle;
+
+  // Left by the thread that switched away for the thread switched to, since a thread can neither delete the stack
+  // it is running on nor let another worker run it before its registers are saved (see after_switch).
+  TCB* finished;
+  TCB* requeue;
+  spin_lock* release;
+
+  // Pool of finished threads, linked through next_free. Their mappings are reused as they are, so a pooled thread
+  // costs no system call and the stack pages it touched are still mapped.
+  TCB* free_tcbs;
+  int free_tcb_count;
+
+  // Picks the first worker to steal from.
+  unsigned int seed;
+};
+
+static Worker WORKERS[THREAD_MAX_WORKERS];
+
+// The worker of this kernel thread. A thread can go on on another kernel thread after any switch, so the library
+// reads it afresh through current_worker() and never keeps a worker across a switch.
+static __thread Worker* CURRENT_WORKER;
+
+static Worker* current_worker() __attribute__((noinline));
+static Worker* current_worker() {
+  return CURRENT_WORKER;
+}
+
+// Bytes of a mapping taken by the TCB, keeping the stack top below it 16-byte aligned.
+static const size_t TCB_SPACE = (sizeof(TCB) + 15) & ~(size_t) 15;
+
+static const size_t THREAD_PAGE_SIZE = (size_t) sysconf(_SC_PAGESIZE);
+
+static size_t page_round(size_t bytes) {
+  return (bytes + THREAD_PAGE_SIZE - 1) & ~(THREAD_PAGE_SIZE - 1);
+}
+
+// Takes a thread from the worker's pool, or maps a new stack with its TCB. The mapping is reserved, not committed:
+// pages only take memory once the thread touches them. The guard pages below the stack are inaccessible, so an
+// overflow faults instead of running into other memory. NULL attrs are the defaults. Throws bad_alloc.
+static TCB* tcb_new(const thread_attr_t* attrs) {
+  Worker* worker = current_worker();
+  thread_attr_t defaults;
+  size_t stack_size, guard_size, map_size;
+  bool poolable;
+  TCB* thread;
+  char* map;
+
+  thread_attr_init(&defaults);
+  if (attrs == NULL) {
+    attrs = &defaults;
+  }
+  stack_size = attrs->stack_size < THREAD_STACK_MIN ? THREAD_STACK_MIN : attrs->stack_size;
+  guard_size = page_round(attrs->guard_size);
+  map_size = guard_size + page_round(stack_size + TCB_SPACE);
+  poolable = map_size == page_round(defaults.guard_size) + page_round(defaults.stack_size + TCB_SPACE)
+             && guard_size == page_round(defaults.guard_size);
+
+  if (poolable && worker->free_tcbs != NULL) {
+    thread = worker->free_tcbs;
+    worker->free_tcbs = thread->next_free;
+    worker->free_tcb_count--;
+  } else {
+    map = (char*) mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                       -1, 0);
+    if (map == MAP_FAILED) {
+      throw bad_alloc();
+    }
+    if (guard_size != 0 && mprotect(map, guard_size, PROT_NONE) != 0) {
+      munmap(map, map_size);
+      throw bad_alloc();
+    }
+    thread = new (map + map_size - TCB_SPACE) TCB;
+    thread->map = map;
+    thread->map_size = map_size;
+    thread->stack = map + guard_size;
+    thread->poolable = poolable;
+  }
+  thread->next_free = NULL;
+  thread->alarm_blocked = false;
+  thread->status = 0;
+  return thread;
+}
+
+// Puts a finished thread into the worker's pool, or unmaps it if it has other sizes or the pool is full.
+static void tcb_delete(TCB* thread) {
+  Worker* worker = current_worker();
+
+  if (thread->poolable && worker->free_tcb_count < THREAD_POOL_SIZE) {
+    thread->next_free = worker->free_tcbs;
+    worker->free_tcbs = thread;
+    worker->free_tcb_count++;
+    return;
+  }
+  munmap(thread->map, thread->map_size);
+}
+
+// Switches from one thread to another. The signal mask only changes when exactly one of the two threads is inside
+// the SIGALRM handler of the interrupt library: the other one runs with SIGALRM unblocked. (swapcontext saved and
+// restored the whole mask on every switch.)
+static void switch_thread(TCB* from, TCB* to) {
+  if (from->alarm_blocked != to->alarm_blocked) {
+    sigset_t alarm;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    sigprocmask(to->alarm_blocked ? SIG_BLOCK : SIG_UNBLOCK, &alarm, NULL);
+  }
+  context_swap(from, to);
+}
+
+// Thread queues and the lock/CV maps take a node per push or insert. By default the nodes come from dmm
+// node pools (p0/dmm_allocator.h): queues are lists, so a push takes a pooled node and a pop gives it back,
+// and scheduling never reaches malloc once the pools are warm. -DDMM_NO_POOL builds the plain std containers.
+#ifndef DMM_NO_POOL
+typedef queue<TCB*, list<TCB*, dmm_pool_allocator<TCB*> > > tcb_queue;
+template <class K, class V>
+struct tcb_map {
+  typedef map<K, V, less<K>, dmm_pool_allocator<pair<const K, V> > > type;
+};
+#else
+typedef queue<TCB*> tcb_queue;
+template <class K, class V>
+struct tcb_map {
+  typedef map<K, V> type;
+};
+#endif
+
+// Locks and CVs, split over stripes by lock number so that workers using different locks do not contend. A CV is
+// in the stripe of its lock, so thread_wait only takes one stripe.
+struct alignas(64) sync_stripe {
+  spin_lock guard;
+
+  // Lock queue map is a structure to hold a queue of threads waiting for a specific lock
+  tcb_map<unsigned int, tcb_queue>::type lock_queue_map;
 
-// Thread which handles switching of threads. Also handles cleanup upon completion of execution.
-static TCB* SWITCH_THREAD;
+  // CV wait queue map is a structure to hold a queue of threads waiting for a signal of a lock, condiition variable pair.
+  tcb_map<pair<unsigned int, unsigned int>, tcb_queue>::type cv_queue_map;
 
-// Ready queue holds all threads which are ready.
-static queue<TCB*> READY_QUEUE;
+  // Lock owner map tells us which thread owns a specific lock.
+  tcb_map<unsigned int, TCB*>::type lock_owner_map;
+};
 
-// Lock queue map is a structure to hold a queue of threads waiting for a specific lock
-static map<unsigned int, queue<TCB*> > LOCK_QUEUE_MAP;
+static sync_stripe SYNC_STRIPES[SYNC_STRIPE_COUNT];
 
-// CV wait queue map is a structure to hold a queue of threads waiting for a signal of a lock, condiition variable pair.
-static map<pair<unsigned int, unsigned int>, queue<TCB*> > CV_QUEUE_MAP;
+static sync_stripe* stripe_of(unsigned int lock) {
+  return &SYNC_STRIPES[lock % SYNC_STRIPE_COUNT];
+}
 
-// Lock owner map tells us which thread owns a specific lock.
-static map<unsigned int, TCB*> LOCK_OWNER_MAP;
+// Threads running or ready on any worker. A blocked thread can only be woken by one of them, so once there are none
+// every thread has finished or deadlocked.
+static atomic<long> ACTIVE_THREADS(0);
+
+static void count_active(long delta) {
+  if (WORKER_COUNT == 1) {
+    ACTIVE_THREADS.store(ACTIVE_THREADS.load(memory_order_relaxed) + delta, memory_order_relaxed);
+  } else {
+    ACTIVE_THREADS.fetch_add(delta);
+  }
+}
+
+// Idle workers asleep in idle_wait, woken by wake_worker.
+static atomic<int> SLEEPING_WORKERS(0);
+static pthread_mutex_t IDLE_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t IDLE_COND = PTHREAD_COND_INITIALIZER;
+
+// Set once a worker ends the program, so that only one does.
+static atomic<bool> EXITING(false);
 
 // No thread library calls can be made without initializing the library first through thread_libint(...);
 static bool islib = false;
 
+// With more than one worker the interrupt library's flag cannot make the library atomic: it is one flag for all
+// kernel threads, and interrupt_disable asserts that nobody else has it. Each kernel thread sets this one instead
+// while it is in the library, and thread_yield ignores the preemptions it gets meanwhile. It is thread-local, so
+// setting it is one store that a preemption cannot split.
+static __thread volatile sig_atomic_t IN_LIBRARY = 0;
+
 // Created new functions for interrupts so we could globally disable and enable for testing by commenting out the method body.
 void interrupt_enable2() {
-  interrupt_enable();
+  if (WORKER_COUNT == 1) {
+    interrupt_enable();
+    return;
+  }
+  atomic_signal_fence(memory_order_seq_cst);
+  IN_LIBRARY = 0;
 }
 
 void interrupt_disable2() {
-  interrupt_disable();
+  if (WORKER_COUNT == 1) {
+    interrupt_disable();
+    return;
+  }
+  IN_LIBRARY = 1;
+  atomic_signal_fence(memory_order_seq_cst);
 }
 
-// Shorter call to swap to the switch thread from the running thread.
-static void swapToSwitchThread(){
-  swapcontext(RUNNING_THREAD->ucontext, SWITCH_THREAD->ucontext);
+// Wakes an idle worker, if one is asleep, for a thread just made ready.
+static void wake_worker() {
+  if (WORKER_COUNT == 1) {
+    return;
+  }
+  // Pairs with the fence in idle_wait: either the sleeper sees the new thread or this sees the sleeper.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (SLEEPING_WORKERS.load(memory_order_relaxed) > 0) {
+    pthread_mutex_lock(&IDLE_MUTEX);
+    pthread_cond_signal(&IDLE_COND);
+    pthread_mutex_unlock(&IDLE_MUTEX);
+  }
 }
 
-// Shorter call to swap to the running thread from the switch thread.
-static void swapToRunningThread(){
-  swapcontext(SWITCH_THREAD->ucontext, RUNNING_THREAD->ucontext);
+// Makes a new or woken thread ready on the running thread's worker. Throws bad_alloc.
+static void make_ready(TCB* thread) {
+  count_active(1);
+  try {
+    current_worker()->ready.push(thread);
+  }
+  catch (const bad_alloc &) {
+    count_active(-1);
+    throw;
+  }
+  wake_worker();
 }
 
-// Cleans up the thread if it is not null by deleting the stack, ucontext, and thread itself.
-static void cleanup() {
-  if (RUNNING_THREAD == NULL) {
-    return;
+// Takes the next thread for a worker: its own oldest ready thread, or else the oldest one of another worker,
+// trying them all from a random one on.
+static TCB* find_ready(Worker* worker) {
+  TCB* next = worker->ready.take();
+
+  if (next != NULL || WORKER_COUNT == 1) {
+    return next;
   }
-  if (RUNNING_THREAD->status == 3){
-    delete (char*) RUNNING_THREAD->ucontext->uc_stack.ss_sp;
-    RUNNING_THREAD->ucontext->uc_stack.ss_sp = NULL;
-    RUNNING_THREAD->ucontext->uc_stack.ss_size = 0;
-    RUNNING_THREAD->ucontext->uc_stack.ss_flags = 0;
-    RUNNING_THREAD->ucontext->uc_link = NULL;
-    delete RUNNING_THREAD->ucontext;
-    delete RUNNING_THREAD;
-    RUNNING_THREAD = NULL;
+  worker->seed = worker->seed * 1103515245 + 12345;
+  int first = (worker->seed >> 16) % WORKER_COUNT;
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    Worker* victim = &WORKERS[(first + i) % WORKER_COUNT];
+    if (victim != worker && (next = victim->ready.take()) != NULL) {
+      return next;
+    }
   }
+  return NULL;
 }
 
+static bool any_ready() {
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    if (!WORKERS[i].ready.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
 
-static void process(thread_startfunc_t func, void *arg) {
+// Finishes what the thread switched away from left to do: deletes it if it finished, makes it ready again if it
+// yielded, and releases the stripe it blocked in. Until then no other worker can take it and run on its stack while
+// its registers are still being saved. Runs on the thread that was switched to, right after the switch.
+static void after_switch() {
+  Worker* worker = current_worker();
+
+  if (worker->finished != NULL) {
+    tcb_delete(worker->finished);
+    worker->finished = NULL;
+  }
+  if (worker->requeue != NULL) {
+    worker->ready.push(worker->requeue);
+    worker->requeue = NULL;
+    wake_worker();
+  }
+  if (worker->release != NULL) {
+    worker->release->unlock();
+    worker->release = NULL;
+  }
+}
+
+// Switches from the running thread, which is already on a lock or CV queue, finished or yielding, straight to the
+// next ready thread. Returns once the thread is switched back to, which may be on another worker. Interrupts must
+// be disabled.
+static void schedule() {
+  Worker* worker = current_worker();
+  TCB* prev = worker->running;
+  TCB* next = find_ready(worker);
+
+  if (next == NULL) {
+    if (worker->requeue == prev) {
+      // A yield with no other thread ready: keep running.
+      worker->requeue = NULL;
+      return;
+    }
+    // At this point, no thread is ready on any worker.
+    next = worker->idle;
+  }
+  worker->running = next;
+  switch_thread(prev, next);
+  // Back on this thread: clean up after the thread that switched here.
+  after_switch();
+}
 
-  //switch to RUNNING_THREAD thread to start func
-  //interrupt_disable2();
-  //switchtorunningthread();
+// Blocks the running thread, which is already on a lock or CV queue of the given stripe. The stripe stays locked
+// until the thread has switched away, so nobody can wake it before.
+static void block(spin_lock* guard) {
+  current_worker()->release = guard;
+  count_active(-1);
+  schedule();
+}
+
+// Ends the running thread. The next thread on its worker deletes it.
+static void finish() {
+  Worker* worker = current_worker();
 
-  // While the ready queue still has threads to run.
-  while (!READY_QUEUE.empty()) {
-    // Always try to delete thread if it is done.
-    cleanup();
-    // RUNNING_THREAD is set to be the head of next ready queue.
-    RUNNING_THREAD = READY_QUEUE.front();
-    READY_QUEUE.pop();
+  worker->running->status = 3;
+  worker->finished = worker->running;
+  count_active(-1);
+  schedule();
+}
 
-    // swapcontext into next thread from this thread
-    swapToRunningThread();
+// Waits for a ready thread on any worker, spinning for a while and then asleep until wake_worker.
+static void idle_wait() {
+  for (int i = 0; i < 64; i++) {
+    if (any_ready()) {
+      return;
+    }
+    sched_yield();
+  }
+  pthread_mutex_lock(&IDLE_MUTEX);
+  SLEEPING_WORKERS++;
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!any_ready() && ACTIVE_THREADS.load() != 0) {
+    // The timeout is a safety net; wake_worker does not miss a sleeper.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 10000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&IDLE_COND, &IDLE_MUTEX, &deadline);
   }
-  // At this point, ALL threads are done running or deadlocked.
-  // Do one last cleanup call.
-  cleanup();
-  // Exit.
-  cout << "Thread library exiting.\n";
-  exit(0);
+  SLEEPING_WORKERS--;
+  pthread_mutex_unlock(&IDLE_MUTEX);
 }
 
-// Initializes the thread library.
+// Runs the idle thread of a worker: runs ready threads, from its own deque or stolen, and waits for more when there
+// are none. Once no thread can run anymore, after the last thread finished or the rest deadlocked, ends the program.
+static void idle_loop() {
+  for (;;) {
+    // Do the cleanup left by the thread that switched here.
+    after_switch();
+    if (ACTIVE_THREADS.load() == 0) {
+      if (!EXITING.exchange(true)) {
+        cout << "Thread library exiting.\n";
+        exit(0);
+      }
+      // Another worker is ending the program.
+      pause();
+    }
+    Worker* worker = current_worker();
+    TCB* next = find_ready(worker);
+    if (next == NULL) {
+      idle_wait();
+      continue;
+    }
+    worker->running = next;
+    switch_thread(worker->idle, next);
+  }
+}
+
+// Idle thread of the first worker, on a stack of its own since the first thread runs on the program's stack.
+static void process(thread_startfunc_t func, void *arg) {
+  idle_loop();
+}
+
+// Kernel thread of the other workers. Their idle threads run on the kernel thread's own stack.
+static void* worker_main(void* arg) {
+  Worker* worker = (Worker*) arg;
+  TCB idle = TCB();
+
+  CURRENT_WORKER = worker;
+  IN_LIBRARY = 1;
+  worker->idle = &idle;
+  worker->running = &idle;
+  idle_loop();
+  return NULL;
+}
+
+// Initializes the thread library. THREAD_WORKERS=K in the environment runs the threads on K kernel threads (up to
+// THREAD_MAX_WORKERS); by default they share one, which the interrupt library's synchronous preemptions expect.
 int thread_libinit(thread_startfunc_t func, void *arg) {
   if (islib) {
     // printf("Thread library cannot be reinitialized.");
@@ -121,25 +671,22 @@ int thread_libinit(thread_startfunc_t func, void *arg) {
 
   islib = true;
 
-  // Code from specification to set up a new thread. We will initialize the SWITCH_THREAD first.
+  const char* workers = getenv("THREAD_WORKERS");
+  if (workers != NULL && atoi(workers) > 1) {
+    WORKER_COUNT = atoi(workers) < THREAD_MAX_WORKERS ? atoi(workers) : THREAD_MAX_WORKERS;
+  }
+  for (int i = 0; i < WORKER_COUNT; i++) {
+    WORKERS[i].seed = i + 1;
+  }
+  CURRENT_WORKER = &WORKERS[0];
+
+  // Code from specification to set up a new thread. We will initialize the idle thread first.
   try {
-    // Initialize switch thread struct variables.
-    SWITCH_THREAD = new TCB;
-    SWITCH_THREAD->status = 0;
-
-    // Set up the ucontext.
-    SWITCH_THREAD->ucontext = new ucontext_t;
-    getcontext(SWITCH_THREAD->ucontext);
-    SWITCH_THREAD->ucontext->uc_stack.ss_sp = new char [STACK_SIZE];
-    SWITCH_THREAD->ucontext->uc_stack.ss_size = STACK_SIZE;
-    SWITCH_THREAD->ucontext->uc_stack.ss_flags = 0;
-    SWITCH_THREAD->ucontext->uc_link = NULL;
-    makecontext(SWITCH_THREAD->ucontext, (void (*)()) process, 2, func, arg);
+    // Initialize idle thread struct variables and set up the context.
+    WORKERS[0].idle = tcb_new(NULL);
+    context_init(WORKERS[0].idle, process, func, arg);
   }
   catch (bad_alloc b) {
-    delete (char*) SWITCH_THREAD->ucontext->uc_stack.ss_sp;
-    delete SWITCH_THREAD->ucontext;
-    delete SWITCH_THREAD;
     return -1;
   }
 
@@ -149,37 +696,56 @@ int thread_libinit(thread_startfunc_t func, void *arg) {
   }
 
   // Since thread_create(...) added the thread to the ready queue, we should go ahead and pop it off to run it.
-  RUNNING_THREAD = READY_QUEUE.front();
-  READY_QUEUE.pop();
+  WORKERS[0].running = WORKERS[0].ready.take();
+
+  // Start the other workers. They steal the threads this one creates. A worker whose kernel thread cannot be
+  // started stays empty.
+  for (int i = 1; i < WORKER_COUNT; i++) {
+    pthread_t kernel_thread;
+    if (pthread_create(&kernel_thread, NULL, worker_main, &WORKERS[i]) != 0) {
+      break;
+    }
+  }
 
   // Call the function manually.
   func(arg);
   interrupt_disable2();
 
-  // Once the function has been called and executed, we swap to switch thread for cleanup and so that we may run our
-  // next thread if there are any. We set the first thread status to complete.
-  RUNNING_THREAD->status = 3;
-  swapToSwitchThread();
+  // Once the function has been called and executed, the first thread is complete and we switch to the next thread
+  // if there are any.
+  finish();
 }
 
 // "Trampoline method" as described on Piazza and lecture
 static void STUB(thread_startfunc_t func, void *arg) {
 
-  // We enable interrupts before since this method begins execution directly after a swapcontext. We always must disable
-  // interrupts before swapcontext, and so must enable them to begin.
+  // A new thread begins here instead of returning from schedule(), so it cleans up after the thread that switched
+  // to it.
+  after_switch();
+
+  // We enable interrupts before since this method begins execution directly after a context switch. We always must
+  // disable interrupts before switching, and so must enable them to begin.
   interrupt_enable2();
   func(arg);
   interrupt_disable2();
 
-  // The thread is done executing.
-  RUNNING_THREAD->status = 3;
+  // The thread is done executing: it is deleted by the next one off of the ready queue.
+  finish();
+}
 
-  // Switch to the switch thread to clean this finished thread up and get the next one off of the ready queue.
-  swapToSwitchThread();
+// The default attributes: a STACK_SIZE stack with one guard page.
+void thread_attr_init(thread_attr_t *attrs) {
+  attrs->stack_size = STACK_SIZE;
+  attrs->guard_size = THREAD_PAGE_SIZE;
 }
 
-// Creates a new thread with the given start function and arguments.
+// Creates a new thread with the given start function and arguments and the default attributes.
 int thread_create(thread_startfunc_t func, void *arg) {
+  return thread_create_ex(func, arg, NULL);
+}
+
+// Creates a new thread with the given start function and arguments and the stack given by attrs.
+int thread_create_ex(thread_startfunc_t func, void *arg, const thread_attr_t *attrs) {
   interrupt_disable2();
 
   if (!islib) {
@@ -198,28 +764,21 @@ int thread_create(thread_startfunc_t func, void *arg) {
     * remember to try catch every time we create new ucontext_t
     */
 
-  TCB* newThread;
+  TCB* newThread = NULL;
   try {
-    // Initialize struct variables
-    newThread = new TCB;
-    newThread->status = 0;
-
-    // Setup the ucontext and give it the input function to execute.
-    newThread->ucontext = new ucontext_t;
-    getcontext(newThread->ucontext);
-    newThread->ucontext->uc_stack.ss_sp = new char [STACK_SIZE];
-    newThread->ucontext->uc_stack.ss_size = STACK_SIZE;
-    newThread->ucontext->uc_stack.ss_flags = 0;
-    newThread->ucontext->uc_link = NULL;
-    makecontext(newThread->ucontext, (void (*)())STUB, 2, func, arg);
-
-    // Push the thread on to the ready queue, since it is now ready.
-    READY_QUEUE.push(newThread);
+    // Get the TCB and its stack in one mapping, from the pool if a finished thread is left there.
+    newThread = tcb_new(attrs);
+
+    // Setup the context and give it the input function to execute.
+    context_init(newThread, STUB, func, arg);
+
+    // Push the thread on to this worker's ready queue, since it is now ready.
+    make_ready(newThread);
   }
   catch (bad_alloc b) {
-    delete (char*) newThread->ucontext->uc_stack.ss_sp;
-    delete newThread->ucontext;
-    delete newThread;
+    if (newThread != NULL) {
+      tcb_delete(newThread);
+    }
     interrupt_enable2();
     return -1;
   }
@@ -227,8 +786,33 @@ int thread_create(thread_startfunc_t func, void *arg) {
   return 0;
 }
 
-// Yields to the next thread on the ready queue, and current thread is placed at the end of ready queue.
+// True if the caller is the interrupt library: a preemption, from its SIGALRM handler or a synchronous one. The
+// library's functions are contiguous, from interrupt_disable to test_set_interrupt.
+static bool called_by_interrupts(void* caller) {
+  return (char*) caller >= (char*) interrupt_disable && (char*) caller <= (char*) test_set_interrupt;
+}
+
+// True if the caller is the interrupt library and it runs inside its SIGALRM handler, where the kernel blocks
+// SIGALRM. Only preemptions pay for the sigprocmask call that reads the mask.
+static bool called_in_alarm_handler(void* caller) {
+  if (!called_by_interrupts(caller)) {
+    return false;
+  }
+  sigset_t mask;
+  sigprocmask(SIG_BLOCK, NULL, &mask);
+  return sigismember(&mask, SIGALRM);
+}
+
+// Yields to the next ready thread, and current thread is placed at the end of its worker's ready queue.
 int thread_yield(void) {
+  void* caller = __builtin_return_address(0);
+
+  // A preemption while this kernel thread is in the library (only possible with several workers) is dropped.
+  if (IN_LIBRARY && called_by_interrupts(caller)) {
+    return 0;
+  }
+  bool in_handler = called_in_alarm_handler(caller);
+
   interrupt_disable2();
   if (!islib) {
     // printf("Thread library must be initialized first. Call thread_libinit(...) first.");
@@ -236,11 +820,15 @@ int thread_yield(void) {
     return -1;
   }
 
-  // Push current thread to back of the ready queue.  
-  READY_QUEUE.push(RUNNING_THREAD);
+  // Current thread goes to the back of the ready queue once it has switched away, so no other worker takes it
+  // before.
+  TCB* self = current_worker()->running;
+  current_worker()->requeue = self;
 
-  //Switch to the switch thread to get the next one off of the ready queue.
-  swapToSwitchThread();
+  // Switch to the next one off of the ready queue.
+  self->alarm_blocked = in_handler;
+  schedule();
+  self->alarm_blocked = false;
   interrupt_enable2();
   return 0;
 }
@@ -254,24 +842,30 @@ int thread_lock(unsigned int lock){
     interrupt_enable2();
     return -1;
   }
+  TCB* self = current_worker()->running;
+  sync_stripe* stripe = stripe_of(lock);
+
+  stripe->guard.lock();
   // Cannot try to re-lock if lock is already held.
-  if (LOCK_OWNER_MAP[lock] == RUNNING_THREAD) {
+  if (stripe->lock_owner_map[lock] == self) {
+    stripe->guard.unlock();
     interrupt_enable2();
     return -1;
   }
 
   // Check if there is a queue for the lock in the lock queue map, and if not -- add one.
-  if (LOCK_QUEUE_MAP.count(lock) == 0) {
-    LOCK_OWNER_MAP[lock] = NULL; // Lock has no owner yet.
-    queue<TCB*> NEW_LOCK_QUEUE; // Create empty queue.
-    LOCK_QUEUE_MAP.insert(pair<unsigned int, queue<TCB*> >(lock, NEW_LOCK_QUEUE) ); // Insert.
+  if (stripe->lock_queue_map.count(lock) == 0) {
+    stripe->lock_owner_map[lock] = NULL; // Lock has no owner yet.
+    tcb_queue NEW_LOCK_QUEUE; // Create empty queue.
+    stripe->lock_queue_map.insert(pair<unsigned int, tcb_queue>(lock, NEW_LOCK_QUEUE) ); // Insert.
   }
   // If the lock is owned by another thread.
-  if (LOCK_OWNER_MAP[lock] != NULL) {
-    LOCK_QUEUE_MAP[lock].push(RUNNING_THREAD); // Push current thread to end of ready queue.
-    swapToSwitchThread(); // Switch thread to run the head of the ready queue.
+  if (stripe->lock_owner_map[lock] != NULL) {
+    stripe->lock_queue_map[lock].push(self); // Push current thread to end of lock queue.
+    block(&stripe->guard); // Switch thread to run the head of the ready queue.
   } else {
-    LOCK_OWNER_MAP[lock] = RUNNING_THREAD; // Give lock to this thread.
+    stripe->lock_owner_map[lock] = self; // Give lock to this thread.
+    stripe->guard.unlock();
   }
 
   // We can re-enable interrupts for forced yields.
@@ -289,24 +883,30 @@ int thread_unlock(unsigned int lock){
     interrupt_enable2();
     return -1;
   }
+  TCB* self = current_worker()->running;
+  sync_stripe* stripe = stripe_of(lock);
 
+  stripe->guard.lock();
   // If no one holds the lock, if the lock owner is null, or if the current thread doesn't hold the lock,
   // attempting to unlock the lock is an error.
-  if (LOCK_OWNER_MAP.count(lock) == 0 || LOCK_OWNER_MAP[lock] == NULL || LOCK_OWNER_MAP[lock] != RUNNING_THREAD) {
+  if (stripe->lock_owner_map.count(lock) == 0 || stripe->lock_owner_map[lock] == NULL
+      || stripe->lock_owner_map[lock] != self) {
+    stripe->guard.unlock();
     interrupt_enable2();
     return -1;
   }
 
   // Releases the lock owner.
-  LOCK_OWNER_MAP[lock] = NULL;
+  stripe->lock_owner_map[lock] = NULL;
 
   // If the lock queue is not empty:
-  if (!LOCK_QUEUE_MAP[lock].empty()) {
-    READY_QUEUE.push(LOCK_QUEUE_MAP[lock].front()); // Pushed blocked thread to ready queue.
-    LOCK_OWNER_MAP[lock] = LOCK_QUEUE_MAP[lock].front(); // Hand-off lock: Piazza @439
-    LOCK_QUEUE_MAP[lock].pop(); // Remove thread from blocked queue.
+  if (!stripe->lock_queue_map[lock].empty()) {
+    make_ready(stripe->lock_queue_map[lock].front()); // Pushed blocked thread to ready queue.
+    stripe->lock_owner_map[lock] = stripe->lock_queue_map[lock].front(); // Hand-off lock: Piazza @439
+    stripe->lock_queue_map[lock].pop(); // Remove thread from blocked queue.
   }
-  
+  stripe->guard.unlock();
+
   // We can re-enable interrupts for forced yields.
   interrupt_enable2();
   return 0;
@@ -320,32 +920,38 @@ int thread_wait(unsigned int lock, unsigned int cond) {
     interrupt_enable2();
     return -1;
   }
+  TCB* self = current_worker()->running;
+  sync_stripe* stripe = stripe_of(lock);
 
+  stripe->guard.lock();
   // The code below is copied from unlock, because we have to unlock the held lock.
-  if (LOCK_OWNER_MAP.count(lock) == 0 || LOCK_OWNER_MAP[lock] == NULL || LOCK_OWNER_MAP[lock] != RUNNING_THREAD) {
+  if (stripe->lock_owner_map.count(lock) == 0 || stripe->lock_owner_map[lock] == NULL
+      || stripe->lock_owner_map[lock] != self) {
+    stripe->guard.unlock();
     interrupt_enable2();
     return -1;
   }
 
   // Releases the lock owner.
-  LOCK_OWNER_MAP[lock] = NULL;
+  stripe->lock_owner_map[lock] = NULL;
 
   // If the lock queue is not empty:
-  if (!LOCK_QUEUE_MAP[lock].empty()) {
-    READY_QUEUE.push(LOCK_QUEUE_MAP[lock].front()); // Pushed blocked thread to ready queue.
-    LOCK_OWNER_MAP[lock] = LOCK_QUEUE_MAP[lock].front(); // Hand-off lock: Piazza @439
-    LOCK_QUEUE_MAP[lock].pop(); // Remove thread from blocked queue.
+  if (!stripe->lock_queue_map[lock].empty()) {
+    make_ready(stripe->lock_queue_map[lock].front()); // Pushed blocked thread to ready queue.
+    stripe->lock_owner_map[lock] = stripe->lock_queue_map[lock].front(); // Hand-off lock: Piazza @439
+    stripe->lock_queue_map[lock].pop(); // Remove thread from blocked queue.
   }
   // If CV waiting queue is not initialized, we initialize it.
   pair<unsigned int, unsigned int> lock_cond_pair = make_pair(lock,cond);
-  if (CV_QUEUE_MAP.find(lock_cond_pair) == CV_QUEUE_MAP.end()){
-    queue<TCB*> NEW_CV_QUEUE;
-    CV_QUEUE_MAP[lock_cond_pair] = NEW_CV_QUEUE;
+  if (stripe->cv_queue_map.find(lock_cond_pair) == stripe->cv_queue_map.end()){
+    tcb_queue NEW_CV_QUEUE;
+    stripe->cv_queue_map[lock_cond_pair] = NEW_CV_QUEUE;
   }
   // Push thread to tail of CV waiting queue.
-  CV_QUEUE_MAP[lock_cond_pair].push(RUNNING_THREAD);
-  // Switch thread so that thread from the front of ready queue runs.
-  swapToSwitchThread();
+  stripe->cv_queue_map[lock_cond_pair].push(self);
+  // Switch thread so that thread from the front of ready queue runs. Releasing the lock and waiting on the CV are one
+  // step for the other workers, since the stripe stays locked until the switch.
+  block(&stripe->guard);
   interrupt_enable2();
   // After returning from swapcontext and being awoken, we must first reacquire the lock.
   return thread_lock(lock);
@@ -359,12 +965,16 @@ int thread_signal(unsigned int lock, unsigned int cond){
     interrupt_enable2();
     return -1;
   }
+  sync_stripe* stripe = stripe_of(lock);
+
+  stripe->guard.lock();
   // Take first waiter from CV wait queue and push to end of ready queue.
   pair<unsigned int, unsigned int> lock_cond_pair = make_pair(lock,cond);
-  if (!CV_QUEUE_MAP[lock_cond_pair].empty()){
-    READY_QUEUE.push(CV_QUEUE_MAP[lock_cond_pair].front());
-    CV_QUEUE_MAP[lock_cond_pair].pop();
+  if (!stripe->cv_queue_map[lock_cond_pair].empty()){
+    make_ready(stripe->cv_queue_map[lock_cond_pair].front());
+    stripe->cv_queue_map[lock_cond_pair].pop();
   };
+  stripe->guard.unlock();
   interrupt_enable2(); // BADENABLE
   return 0;
 }
@@ -377,12 +987,16 @@ int thread_broadcast(unsigned int lock, unsigned int cond) {
     interrupt_enable2();
     return -1;
   }
+  sync_stripe* stripe = stripe_of(lock);
+
+  stripe->guard.lock();
   // Take all waiters from CV wait queue and push to end of ready queue.
   pair<unsigned int, unsigned int> lock_cond_pair = make_pair(lock,cond);
-  while (!CV_QUEUE_MAP[lock_cond_pair].empty()){
-    READY_QUEUE.push(CV_QUEUE_MAP[lock_cond_pair].front());
-    CV_QUEUE_MAP[lock_cond_pair].pop();
+  while (!stripe->cv_queue_map[lock_cond_pair].empty()){
+    make_ready(stripe->cv_queue_map[lock_cond_pair].front());
+    stripe->cv_queue_map[lock_cond_pair].pop();
   }
+  stripe->guard.unlock();
   interrupt_enable2();
   return 0;
-}
\ No newline at end of file
+}
@@ -7,12 +7,31 @@
 #ifndef _THREAD_H
 #define _THREAD_H
 
-#define STACK_SIZE 262144	/* size of each thread's stack */
+#include <stddef.h>
+
+#define STACK_SIZE 262144	/* default size of each thread's stack */
 
 typedef void (*thread_startfunc_t) (void *);
 
+/*
+ * Attributes of a thread created with thread_create_ex. thread_attr_init
+ * sets the defaults thread_create uses: a STACK_SIZE stack with one guard
+ * page below it. Stacks are mmap'd and only take memory as their pages are
+ * touched, so a large stack for deep recursion costs nothing until it is
+ * used. A guard page makes a stack overflow fault instead of overwriting
+ * other memory, at the price of an extra kernel memory map per thread
+ * (Linux allows 65530 per process by default, so a program with more
+ * than about 30000 threads needs guard_size 0).
+ */
+typedef struct {
+	size_t stack_size;	/* bytes of stack, at least 16384 */
+	size_t guard_size;	/* bytes below the stack that fault when touched, 0 for none */
+} thread_attr_t;
+
 extern int thread_libinit(thread_startfunc_t func, void *arg); //want to exit
 extern int thread_create(thread_startfunc_t func, void *arg); //want to exit
+extern void thread_attr_init(thread_attr_t *attrs);
+extern int thread_create_ex(thread_startfunc_t func, void *arg, const thread_attr_t *attrs);
 extern int thread_yield(void); // call switch
 extern int thread_lock(unsigned int lock); //call switch
 extern int thread_unlock(unsigned int lock); 
@@ -0,0 +1,65 @@
+#include <iostream>
+#include <time.h>
+#include "thread.h"
+using namespace std;
+
+// Worker benchmark: CPU-bound threads that add their results up under a lock now and then, like deli's cashiers
+// and maker if making a sandwich took work. Prints the wall time; run it with THREAD_WORKERS=1, 2, 4, ... to see
+// how it scales with the kernel threads running it.
+//
+// g++ -O2 -I../p0 -o workers_bench thread.cc workers_bench.cc ../p0/dmm.o libinterrupt.a -ldl -pthread
+// THREAD_WORKERS=4 ./workers_bench
+
+#define THREADS 64
+#define CHUNKS 100
+#define CHUNK_WORK 200000
+
+unsigned int lock1 = 1;
+unsigned int cond1 = 1;
+unsigned long total = 0;
+int finished = 0;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void cruncher(void* arg) {
+  unsigned long x = (unsigned long) arg + 1;
+
+  for (int i = 0; i < CHUNKS; i++) {
+    unsigned long sum = 0;
+    for (int j = 0; j < CHUNK_WORK; j++) {
+      x = x * 6364136223846793005UL + 1442695040888963407UL;
+      sum += x >> 60;
+    }
+    thread_lock(lock1);
+    total += sum;
+    thread_unlock(lock1);
+    thread_yield();
+  }
+  thread_lock(lock1);
+  finished++;
+  thread_signal(lock1, cond1);
+  thread_unlock(lock1);
+}
+
+void parent(void* arg) {
+  double begin = now();
+
+  for (long i = 0; i < THREADS; i++) {
+    thread_create(cruncher, (void*) i);
+  }
+  thread_lock(lock1);
+  while (finished < THREADS) {
+    thread_wait(lock1, cond1);
+  }
+  thread_unlock(lock1);
+  cout << THREADS << " threads, " << (unsigned long) THREADS * CHUNKS * CHUNK_WORK << " steps: "
+       << (now() - begin) / 1e6 << " ms (total " << total << ")\n";
+}
+
+int main() {
+  thread_libinit(parent, NULL);
+}